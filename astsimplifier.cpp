@@ -0,0 +1,291 @@
+#include "astsimplifier.h"
+#include <llvm/Support/Casting.h>
+#include <cmath>
+#include <cstdint>
+
+using namespace llvm;
+
+/// Value of an int, float or bool literal operand
+struct LiteralValue
+{
+    enum Type { None, Int, Float, Bool } type;
+    int64_t intVal;
+    double floatVal;
+    bool boolVal;
+};
+
+static LiteralValue getLiteral(ExprAST* ast)
+{
+    LiteralValue lit{LiteralValue::None, 0, 0.0, false};
+    if (IntLitExprAST* i = dyn_cast<IntLitExprAST>(ast))
+    {
+        lit.type = LiteralValue::Int;
+        lit.intVal = i->getValue();
+    }
+    else if (FloatLitExprAST* f = dyn_cast<FloatLitExprAST>(ast))
+    {
+        lit.type = LiteralValue::Float;
+        lit.floatVal = f->getValue();
+    }
+    else if (BoolLitExprAST* b = dyn_cast<BoolLitExprAST>(ast))
+    {
+        lit.type = LiteralValue::Bool;
+        lit.boolVal = b->getValue();
+    }
+    return lit;
+}
+
+enum class Condition { Unknown, True, False };
+
+/// Same conversions to bool as CodeGen's if and while conditions
+static Condition getCondition(ExprAST* ast)
+{
+    LiteralValue cond = getLiteral(ast);
+    bool value;
+    switch (cond.type)
+    {
+        case LiteralValue::Int:   value = cond.intVal != 0; break;
+        case LiteralValue::Float: value = !std::isnan(cond.floatVal) && cond.floatVal != 0.0; break;
+        case LiteralValue::Bool:  value = cond.boolVal; break;
+        default:                  return Condition::Unknown;
+    }
+    return value ? Condition::True : Condition::False;
+}
+
+/// Same conversion as the UIToFP that CodeGen emits for a CastExprAST
+static LiteralValue castToFloat(LiteralValue lit)
+{
+    if (lit.type == LiteralValue::Int)
+        lit.floatVal = (double)(uint64_t)lit.intVal;
+    else if (lit.type == LiteralValue::Bool)
+        lit.floatVal = lit.boolVal ? 1.0 : 0.0;
+    lit.type = LiteralValue::Float;
+    return lit;
+}
+
+ASTSimplifier::ASTSimplifier(ASTArena &Arena)
+    : arena(Arena)
+{
+}
+
+template <class T, class... Args>
+T* ASTSimplifier::create(const ExprAST* replaced, Args&&... args)
+{
+    T* node = arena.make<T>(std::forward<Args>(args)...);
+    node->line = replaced->line;
+    node->type = replaced->type;
+    return node;
+}
+
+void ASTSimplifier::simplify(FunctionAST* ast)
+{
+    ast->body = simplify(ast->body);
+}
+
+ExprAST* ASTSimplifier::simplify(ExprAST* ast)
+{
+    switch (ast->getKind())
+    {
+        case ExprAST::Unary:  return simplify(static_cast<UnaryExprAST*>(ast));
+        case ExprAST::Binary: return simplify(static_cast<BinaryExprAST*>(ast));
+        case ExprAST::Call:   return simplify(static_cast<CallExprAST*>(ast));
+        case ExprAST::If:     return simplify(static_cast<IfExprAST*>(ast));
+        case ExprAST::While:  return simplify(static_cast<WhileExprAST*>(ast));
+        case ExprAST::For:    return simplify(static_cast<ForExprAST*>(ast));
+        case ExprAST::Var:    return simplify(static_cast<VarExprAST*>(ast));
+        case ExprAST::Assign: return simplify(static_cast<AssignExprAST*>(ast));
+        case ExprAST::Block:  return simplify(static_cast<BlockExprAST*>(ast));
+        case ExprAST::Cast:   return simplify(static_cast<CastExprAST*>(ast));
+        default:              return ast;
+    }
+}
+
+ExprAST* ASTSimplifier::simplify(UnaryExprAST* ast)
+{
+    ast->rhs = simplify(ast->rhs);
+    if (ast->op == '+')
+        return ast->rhs;
+
+    LiteralValue r = getLiteral(ast->rhs);
+    if (ast->op == '-')
+    {
+        // Negating an i1 gives back the same bit
+        if (r.type == LiteralValue::Int)
+            return create<IntLitExprAST>(ast, (int64_t)(0 - (uint64_t)r.intVal));
+        else if (r.type == LiteralValue::Float)
+            return create<FloatLitExprAST>(ast, -r.floatVal);
+        else if (r.type == LiteralValue::Bool)
+            return ast->rhs;
+    }
+    return ast;
+}
+
+ExprAST* ASTSimplifier::simplify(BinaryExprAST* ast)
+{
+    ast->lhs = simplify(ast->lhs);
+    ast->rhs = simplify(ast->rhs);
+
+    // Same semantics as the StringRuntime
+    StringLitExprAST* lStr = dyn_cast<StringLitExprAST>(ast->lhs);
+    StringLitExprAST* rStr = dyn_cast<StringLitExprAST>(ast->rhs);
+    if (lStr && rStr)
+    {
+        if (ast->op == '<')
+            return create<BoolLitExprAST>(ast, lStr->str.compare(rStr->str) < 0);
+        MutableArrayRef<char> str = arena.copy(lStr->str.str() + rStr->str.str());
+        return create<StringLitExprAST>(ast, StringRef(str.data(), str.size()));
+    }
+
+    // The TypeChecker made both sides the same type
+    LiteralValue l = getLiteral(ast->lhs), r = getLiteral(ast->rhs);
+    if (l.type == LiteralValue::None || l.type != r.type)
+        return ast;
+
+    if (l.type == LiteralValue::Float)
+    {
+        switch (ast->op)
+        {
+            case '+': return create<FloatLitExprAST>(ast, l.floatVal + r.floatVal);
+            case '-': return create<FloatLitExprAST>(ast, l.floatVal - r.floatVal);
+            case '*': return create<FloatLitExprAST>(ast, l.floatVal * r.floatVal);
+            case '<': // Unordered comparison, true if either side is a NaN
+                return create<BoolLitExprAST>(ast, std::isnan(l.floatVal) || std::isnan(r.floatVal)
+                                                   || l.floatVal < r.floatVal);
+        }
+    }
+    else if (l.type == LiteralValue::Int)
+    {
+        // Two's complement wrap around, like the IR
+        uint64_t lv = l.intVal, rv = r.intVal;
+        switch (ast->op)
+        {
+            case '+': return create<IntLitExprAST>(ast, (int64_t)(lv + rv));
+            case '-': return create<IntLitExprAST>(ast, (int64_t)(lv - rv));
+            case '*': return create<IntLitExprAST>(ast, (int64_t)(lv * rv));
+            case '<': return create<BoolLitExprAST>(ast, l.intVal < r.intVal);
+        }
+    }
+    else
+    {
+        // i1 arithmetic, where true is -1 for signed comparisons
+        switch (ast->op)
+        {
+            case '+':
+            case '-': return create<BoolLitExprAST>(ast, l.boolVal != r.boolVal);
+            case '*': return create<BoolLitExprAST>(ast, l.boolVal && r.boolVal);
+            case '<': return create<BoolLitExprAST>(ast, l.boolVal && !r.boolVal);
+        }
+    }
+    return ast;
+}
+
+ExprAST* ASTSimplifier::simplify(CallExprAST* ast)
+{
+    for (ExprAST*& arg : ast->args)
+        arg = simplify(arg);
+    return ast;
+}
+
+ExprAST* ASTSimplifier::simplify(IfExprAST* ast)
+{
+    ast->condAST = simplify(ast->condAST);
+    ast->thenAST = simplify(ast->thenAST);
+    ast->elseAST = simplify(ast->elseAST);
+
+    switch (getCondition(ast->condAST))
+    {
+        case Condition::True:  return ast->thenAST;
+        case Condition::False: return ast->elseAST;
+        default:               return ast;
+    }
+}
+
+ExprAST* ASTSimplifier::simplify(WhileExprAST* ast)
+{
+    ast->condAST = simplify(ast->condAST);
+    ast->bodyAST = simplify(ast->bodyAST);
+
+    if (getCondition(ast->condAST) == Condition::False)
+        return create<VoidExprAST>(ast);
+    return ast;
+}
+
+ExprAST* ASTSimplifier::simplify(ForExprAST* ast)
+{
+    ast->startAST = simplify(ast->startAST);
+    ast->endAST = simplify(ast->endAST);
+    ast->bodyAST = simplify(ast->bodyAST);
+
+    // The range is only evaluated once, an empty one never runs the body
+    LiteralValue start = getLiteral(ast->startAST), end = getLiteral(ast->endAST);
+    if (start.type == LiteralValue::Int && end.type == LiteralValue::Int && start.intVal >= end.intVal)
+        return create<VoidExprAST>(ast);
+    return ast;
+}
+
+// Vars are never folded into their uses, the value can change in a loop
+ExprAST* ASTSimplifier::simplify(VarExprAST* ast)
+{
+    ast->initAST = simplify(ast->initAST);
+    return ast;
+}
+
+ExprAST* ASTSimplifier::simplify(AssignExprAST* ast)
+{
+    ast->valueAST = simplify(ast->valueAST);
+    return ast;
+}
+
+ExprAST* ASTSimplifier::simplify(BlockExprAST* ast)
+{
+    // Compact in place, the last expression is the value of the block and always stays
+    size_t count = 0, size = ast->exprs.size();
+    for (size_t i = 0; i < size; ++i)
+    {
+        ExprAST* expr = simplify(ast->exprs[i]);
+        if (i+1 < size && isDiscardable(expr))
+            continue;
+        ast->exprs[count++] = expr;
+    }
+
+    if (count == 1)
+        return ast->exprs[0];
+    ast->exprs = MutableArrayRef<ExprAST*>(ast->exprs.data(), count);
+    return ast;
+}
+
+ExprAST* ASTSimplifier::simplify(CastExprAST* ast)
+{
+    ast->operand = simplify(ast->operand);
+
+    LiteralValue lit = getLiteral(ast->operand);
+    if (lit.type == LiteralValue::None)
+        return ast;
+    return create<FloatLitExprAST>(ast, castToFloat(lit).floatVal);
+}
+
+bool ASTSimplifier::isDiscardable(ExprAST *ast) const
+{
+    switch (ast->getKind())
+    {
+        case ExprAST::IntLit:
+        case ExprAST::FloatLit:
+        case ExprAST::StringLit:
+        case ExprAST::BoolLit:
+        case ExprAST::Void:
+        case ExprAST::Variable:
+            return true;
+        case ExprAST::Cast:
+            return isDiscardable(static_cast<CastExprAST*>(ast)->operand);
+        case ExprAST::Unary:
+            return isDiscardable(static_cast<UnaryExprAST*>(ast)->rhs);
+        case ExprAST::Binary:
+        {
+            // Arithmetic can't trap, and string operations only allocate in the StringRuntime's arena
+            BinaryExprAST* binary = static_cast<BinaryExprAST*>(ast);
+            return isDiscardable(binary->lhs) && isDiscardable(binary->rhs);
+        }
+        default:
+            return false;
+    }
+}
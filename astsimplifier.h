@@ -0,0 +1,40 @@
+#ifndef ASTSIMPLIFIER_H
+#define ASTSIMPLIFIER_H
+
+#include "exprast.h"
+
+/// Simplifies ASTs between the TypeChecker and CodeGen, so less IR reaches LLVM.
+/// Folds arithmetic, comparisons and casts on literals with the same semantics as CodeGen,
+/// resolves ifs with a constant condition to a single branch, and drops statements
+/// whose value is unused and that have no effect. Types are preserved.
+class ASTSimplifier
+{
+public:
+    ASTSimplifier(ASTArena& Arena);
+
+    void simplify(FunctionAST* ast);
+    ExprAST* simplify(ExprAST* ast); ///< Returns the replacement for ast, which may be ast itself
+
+private:
+    ExprAST* simplify(UnaryExprAST* ast);
+    ExprAST* simplify(BinaryExprAST* ast);
+    ExprAST* simplify(CallExprAST* ast);
+    ExprAST* simplify(IfExprAST* ast);
+    ExprAST* simplify(WhileExprAST* ast);
+    ExprAST* simplify(ForExprAST* ast);
+    ExprAST* simplify(VarExprAST* ast);
+    ExprAST* simplify(AssignExprAST* ast);
+    ExprAST* simplify(BlockExprAST* ast);
+    ExprAST* simplify(CastExprAST* ast);
+
+    bool isDiscardable(ExprAST* ast) const; ///< True if dropping the unused expression changes nothing
+
+    /// Allocates a replacement node in the arena, with the line and type of the node it replaces
+    template <class T, class... Args>
+    T* create(const ExprAST* replaced, Args&&... args);
+
+private:
+    ASTArena& arena;
+};
+
+#endif // ASTSIMPLIFIER_H
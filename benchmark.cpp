@@ -0,0 +1,124 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "charscan.h"
+#include "lightscript.h"
+#include "scriptgenerator.h"
+
+using namespace std;
+
+/// Measures how fast Lightscript::compile goes through each kind of generated script,
+/// from lexing to running init(), at every optimization level.
+/// The results are written as JSON, to compare them between revisions.
+/// The SIMD character scanners are first checked against the scalar one.
+
+struct Benchmark
+{
+    const char* name;
+    ScriptShape shape;
+};
+
+static vector<Benchmark> makeBenchmarks()
+{
+    vector<Benchmark> benchmarks(5);
+    benchmarks[0].name = "many-functions";
+    benchmarks[0].shape.functions = 2000;
+    benchmarks[1].name = "deep-if";
+    benchmarks[1].shape.functions = 20;
+    benchmarks[1].shape.ifDepth = 10;
+    benchmarks[2].name = "long-sequences";
+    benchmarks[2].shape.functions = 50;
+    benchmarks[2].shape.statements = 500;
+    benchmarks[3].name = "many-externs";
+    benchmarks[3].shape.functions = 50;
+    benchmarks[3].shape.externs = 5000;
+    benchmarks[4].name = "large-literals";
+    benchmarks[4].shape.functions = 200;
+    benchmarks[4].shape.literalSize = 4096;
+    return benchmarks;
+}
+
+static int usage()
+{
+    cerr << "Usage: lightscript-benchmark [-runs n] [-o results.json]\n"
+            "Keeps the fastest of n runs (3 by default) for each script and optimization level,\n"
+            "and writes the results to stdout unless an output file is given" << endl;
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned runs = 3;
+    const char* output = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-runs") && i+1 < argc)
+            runs = max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-o") && i+1 < argc)
+            output = argv[++i];
+        else
+            return usage();
+    }
+
+    // The Tokenizer only runs the CPU's fastest scanner, a wrong one would make the timings meaningless
+    if (!CharScanner::verify())
+        return 1;
+
+    string json = "{\"runs\": " + to_string(runs) + ", \"results\": [";
+    bool first = true;
+    for (const Benchmark& benchmark : makeBenchmarks())
+    {
+        string script = generateScript(benchmark.shape);
+        for (unsigned level = 0; level <= 3; ++level)
+        {
+            double best = 0;
+            CompileStats bestStats;
+            for (unsigned run = 0; run < runs; ++run)
+            {
+                // The frontend's setup is part of what a host waits for
+                auto start = chrono::steady_clock::now();
+                Lightscript lightscript{script};
+                lightscript.setOptimizationLevel(level);
+                if (!lightscript.compile())
+                {
+                    cerr << "Failed to compile the " << benchmark.name << " script" << endl;
+                    return 1;
+                }
+                double time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                if (!run || time < best)
+                {
+                    best = time;
+                    bestStats = lightscript.getCompileStats();
+                }
+            }
+
+            cerr << benchmark.name << " -O" << level << ": " << best*1000 << " ms, "
+                 << script.size() / best / (1024*1024) << " MiB/s" << endl;
+            json += string(first ? "" : ",") + "\n  {\"script\": \"" + benchmark.name + "\""
+                  + ", \"optLevel\": " + to_string(level)
+                  + ", \"bytes\": " + to_string(script.size())
+                  + ", \"time\": " + to_string(best)
+                  + ", \"bytesPerSecond\": " + to_string(script.size() / best)
+                  + ", \"stats\": " + bestStats.toJSON() + "}";
+            first = false;
+        }
+    }
+    json += "\n]}\n";
+
+    if (!output)
+    {
+        cout << json;
+        return 0;
+    }
+    ofstream file{output};
+    file << json;
+    if (!file)
+    {
+        cerr << "Could not write " << output << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,12 @@
+# Measures the compile throughput on generated scripts, see benchmark.cpp
+TEMPLATE = app
+TARGET = lightscript-benchmark
+CONFIG += console c++11
+CONFIG -= qt app_bundle
+
+SOURCES += benchmark.cpp \
+    scriptgenerator.cpp
+
+HEADERS += scriptgenerator.h
+
+include(lightscript.pri)
@@ -0,0 +1,272 @@
+#include "charscan.h"
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define CHARSCAN_X86
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+enum CharClass : unsigned char
+{
+    cc_space = 1,
+    cc_identifier = 2,
+    cc_number = 4,
+    cc_lineEnd = 8,
+    cc_stringEnd = 16,
+};
+
+/// Class of each byte, used by the scalar implementation and to finish off the tail of a block
+struct CharClassTable
+{
+    unsigned char classes[256];
+
+    CharClassTable() : classes{}
+    {
+        for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'})
+            classes[c] |= cc_space;
+        for (int c = '0'; c <= '9'; ++c)
+            classes[c] |= cc_identifier | cc_number;
+        for (int c = 'a'; c <= 'z'; ++c)
+            classes[c] |= cc_identifier;
+        for (int c = 'A'; c <= 'Z'; ++c)
+            classes[c] |= cc_identifier;
+        classes[(unsigned char)'.'] |= cc_number;
+        classes[(unsigned char)'\n'] |= cc_lineEnd | cc_stringEnd;
+        classes[(unsigned char)'\r'] |= cc_lineEnd | cc_stringEnd;
+        classes[(unsigned char)'"'] |= cc_stringEnd;
+    }
+};
+static const CharClassTable classTable;
+
+/// Skips while the byte is in Class, or until it is in Class if Find is set
+template <unsigned char Class, bool Find>
+static inline size_t scanScalar(const char* str, size_t pos, size_t end)
+{
+    while (pos < end && ((classTable.classes[(unsigned char)str[pos]] & Class) != 0) != Find)
+        ++pos;
+    return pos;
+}
+
+static size_t countNewlinesScalar(const char* str, size_t pos, size_t end)
+{
+    size_t count = 0;
+    for (; pos < end; ++pos)
+        count += str[pos] == '\n';
+    return count;
+}
+
+#ifdef CHARSCAN_X86
+/// All the class tests compare signed bytes, so non-ASCII bytes (negative) never match a range
+static inline __m128i inRange(__m128i v, char lo, char hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo-1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi+1)));
+}
+
+template <unsigned char Class>
+static inline __m128i classMask(__m128i v)
+{
+    switch (Class)
+    {
+    case cc_space:
+        return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), inRange(v, '\t', '\r'));
+    case cc_identifier:
+        return _mm_or_si128(inRange(v, '0', '9'),
+                            inRange(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'));
+    case cc_number:
+        return _mm_or_si128(inRange(v, '0', '9'), _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    case cc_lineEnd:
+        return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                            _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    default: // cc_stringEnd
+        return _mm_or_si128(classMask<cc_lineEnd>(v), _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    }
+}
+
+template <unsigned char Class, bool Find>
+static size_t scanSSE2(const char* str, size_t pos, size_t end)
+{
+    for (; pos + 16 <= end; pos += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(str + pos));
+        unsigned mask = _mm_movemask_epi8(classMask<Class>(v));
+        if (!Find)
+            mask = ~mask & 0xFFFF;
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+    return scanScalar<Class, Find>(str, pos, end);
+}
+
+static size_t countNewlinesSSE2(const char* str, size_t pos, size_t end)
+{
+    size_t count = 0;
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; pos + 16 <= end; pos += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(str + pos));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)));
+    }
+    return count + countNewlinesScalar(str, pos, end);
+}
+
+TARGET_AVX2 static inline __m256i inRange(__m256i v, char lo, char hi)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo-1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi+1), v));
+}
+
+template <unsigned char Class>
+TARGET_AVX2 static inline __m256i classMask(__m256i v)
+{
+    switch (Class)
+    {
+    case cc_space:
+        return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), inRange(v, '\t', '\r'));
+    case cc_identifier:
+        return _mm256_or_si256(inRange(v, '0', '9'),
+                               inRange(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z'));
+    case cc_number:
+        return _mm256_or_si256(inRange(v, '0', '9'), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+    case cc_lineEnd:
+        return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    default: // cc_stringEnd
+        return _mm256_or_si256(classMask<cc_lineEnd>(v), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    }
+}
+
+template <unsigned char Class, bool Find>
+TARGET_AVX2 static size_t scanAVX2(const char* str, size_t pos, size_t end)
+{
+    for (; pos + 32 <= end; pos += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(str + pos));
+        uint32_t mask = _mm256_movemask_epi8(classMask<Class>(v));
+        if (!Find)
+            mask = ~mask;
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+    return scanSSE2<Class, Find>(str, pos, end);
+}
+
+TARGET_AVX2 static size_t countNewlinesAVX2(const char* str, size_t pos, size_t end)
+{
+    size_t count = 0;
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; pos + 32 <= end; pos += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(str + pos));
+        count += __builtin_popcount((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)));
+    }
+    return count + countNewlinesSSE2(str, pos, end);
+}
+#endif // CHARSCAN_X86
+
+static const CharScanner scalarScanner = {
+    "scalar",
+    scanScalar<cc_space, false>,
+    scanScalar<cc_identifier, false>,
+    scanScalar<cc_number, false>,
+    scanScalar<cc_lineEnd, true>,
+    scanScalar<cc_stringEnd, true>,
+    countNewlinesScalar,
+};
+
+#ifdef CHARSCAN_X86
+static const CharScanner sse2Scanner = {
+    "sse2",
+    scanSSE2<cc_space, false>,
+    scanSSE2<cc_identifier, false>,
+    scanSSE2<cc_number, false>,
+    scanSSE2<cc_lineEnd, true>,
+    scanSSE2<cc_stringEnd, true>,
+    countNewlinesSSE2,
+};
+
+static const CharScanner avx2Scanner = {
+    "avx2",
+    scanAVX2<cc_space, false>,
+    scanAVX2<cc_identifier, false>,
+    scanAVX2<cc_number, false>,
+    scanAVX2<cc_lineEnd, true>,
+    scanAVX2<cc_stringEnd, true>,
+    countNewlinesAVX2,
+};
+#endif
+
+const CharScanner& CharScanner::get()
+{
+#ifdef CHARSCAN_X86
+    static const CharScanner& best = __builtin_cpu_supports("avx2") ? avx2Scanner : sse2Scanner;
+    return best;
+#else
+    return scalarScanner;
+#endif
+}
+
+const CharScanner& CharScanner::scalar()
+{
+    return scalarScanner;
+}
+
+/// Compares each function of impl with the scalar one on str[pos, end)
+static bool matchesScalar(const CharScanner& impl, const char* str, size_t pos, size_t end)
+{
+    typedef size_t (*ScanFn)(const char*, size_t, size_t);
+    static const struct { const char* name; ScanFn CharScanner::* fn; } fns[] = {
+        {"skipSpace", &CharScanner::skipSpace}, {"skipIdentifier", &CharScanner::skipIdentifier},
+        {"skipNumber", &CharScanner::skipNumber}, {"findLineEnd", &CharScanner::findLineEnd},
+        {"findStringEnd", &CharScanner::findStringEnd}, {"countNewlines", &CharScanner::countNewlines},
+    };
+    for (const auto& f : fns)
+    {
+        size_t expected = (scalarScanner.*f.fn)(str, pos, end), result = (impl.*f.fn)(str, pos, end);
+        if (result != expected)
+        {
+            fprintf(stderr, "CharScanner %s::%s on [%zu, %zu) returned %zu instead of %zu\n",
+                    impl.name, f.name, pos, end, result, expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CharScanner::verify()
+{
+#ifdef CHARSCAN_X86
+    const CharScanner* impls[] = {&sse2Scanner, __builtin_cpu_supports("avx2") ? &avx2Scanner : nullptr};
+#else
+    const CharScanner* impls[] = {nullptr};
+#endif
+
+    // A run of one byte followed by a run of another, for every pair of a byte from each class,
+    // its boundaries, and the bytes >= 0x80 that signed compares could mistake for small ones.
+    // The ends cut the tails shorter than a vector.
+    static const char bytes[] = {' ', '\t', '\n', '\v', '\r', 'a', 'Z', '0', '9', '.', '"', '#',
+                                 '/', ':', '@', '[', '`', '{', '\0', '\x7f', '\x80', '\xa0', '\xff'};
+    static const size_t starts[] = {0, 1, 15, 16, 17, 31, 32, 33};
+    const size_t size = 80;
+    char str[size];
+    for (const CharScanner* impl : impls)
+    {
+        if (!impl)
+            continue;
+        for (char first : bytes)
+            for (char second : bytes)
+                for (size_t change = 0; change <= size; ++change)
+                {
+                    for (size_t i = 0; i < size; ++i)
+                        str[i] = i < change ? first : second;
+                    for (size_t pos : starts)
+                        for (size_t end : {change, change+1, size})
+                            if (pos <= end && end <= size && !matchesScalar(*impl, str, pos, end))
+                                return false;
+                }
+    }
+    return true;
+}
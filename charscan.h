@@ -0,0 +1,27 @@
+#ifndef CHARSCAN_H
+#define CHARSCAN_H
+
+#include <cstddef>
+
+/// Character class scanning for the Tokenizer, a block of bytes at a time.
+/// The skip* functions return the first position in [pos, end) outside of the class,
+/// the find* functions the first position inside of it, or end if there is none.
+/// Classes are ASCII only and don't depend on the locale.
+struct CharScanner
+{
+    static const CharScanner& get(); ///< Fastest implementation supported by the running CPU
+    static const CharScanner& scalar(); ///< Portable reference implementation
+    /// Runs every implementation the CPU supports on the same inputs, with class changes and ends around
+    /// the vector edges, and compares them to the scalar one. Reports the first mismatch on stderr.
+    static bool verify();
+
+    const char* name; ///< "avx2", "sse2" or "scalar"
+    size_t (*skipSpace)(const char* str, size_t pos, size_t end); ///< Same class as isspace in the C locale
+    size_t (*skipIdentifier)(const char* str, size_t pos, size_t end); ///< [a-zA-Z0-9]
+    size_t (*skipNumber)(const char* str, size_t pos, size_t end); ///< [0-9.]
+    size_t (*findLineEnd)(const char* str, size_t pos, size_t end); ///< '\n' or '\r'
+    size_t (*findStringEnd)(const char* str, size_t pos, size_t end); ///< '"', '\n' or '\r'
+    size_t (*countNewlines)(const char* str, size_t pos, size_t end); ///< Number of '\n' in [pos, end)
+};
+
+#endif // CHARSCAN_H
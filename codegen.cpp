@@ -1,16 +1,17 @@
 #include "codegen.h"
 #include "mcjithelper.h"
+#include "profiler.h"
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/ErrorHandling.h>
 
 using namespace llvm;
 
-static ExprAST *error(const char *str) { fprintf(stderr, "Error: %s\n", str);return 0;}
-static Value* errorV(const char *str) { error(str); return 0; }
-static Function* errorF(const char *str) { error(str); return 0; }
-
-CodeGen::CodeGen(MCJITHelper *Jit)
-    : builder{getGlobalContext()}, jit{Jit}
+CodeGen::CodeGen(MCJITHelper *Jit, LLVMContext& Context)
+    : builder{Context}, body{nullptr}, jit{Jit}
 {
 }
 
@@ -18,200 +19,226 @@ CodeGen::~CodeGen()
 {
 }
 
-Value* CodeGen::codegen(IntLitExprAST* ast)
+Value* CodeGen::codegen(FlatAST::Node n)
 {
-    return ConstantInt::get(getGlobalContext(), APInt(sizeof(ast->val)*8, ast->val, true));
+    switch (body->getKind(n))
+    {
+        case ExprAST::IntLit:
+            return ConstantInt::get(builder.getContext(), APInt(64, body->getInt(n), true));
+        case ExprAST::FloatLit:
+            return ConstantFP::get(builder.getContext(), APFloat(body->getFloat(n)));
+        case ExprAST::StringLit:
+            return createStringLit(n);
+        case ExprAST::BoolLit:
+            if (body->getBool(n))
+                return ConstantInt::getTrue(builder.getContext());
+            else
+                return ConstantInt::getFalse(builder.getContext());
+        case ExprAST::Variable:
+            return createVariable(n);
+        case ExprAST::Void:
+            // Nothing to compute, void expressions never have their value used
+            return 0;
+        case ExprAST::Unary:
+            return createUnary(n);
+        case ExprAST::Binary:
+            return createBinary(n);
+        case ExprAST::Block:
+        {
+            Value *last = 0;
+            for (FlatAST::Node expr : body->getOperands(n))
+                last = codegen(expr);
+            return last;
+        }
+        case ExprAST::Call:
+            return createCall(n);
+        case ExprAST::If:
+            return createIf(n);
+        case ExprAST::While:
+            return createWhile(n);
+        case ExprAST::For:
+            return createFor(n);
+        case ExprAST::Var:
+            return createVar(n);
+        case ExprAST::Assign:
+            builder.CreateStore(codegen(body->getOperands(n)[0]), symbols[body->getString(n)]);
+            return 0;
+        case ExprAST::Cast:
+            return builder.CreateUIToFP(codegen(body->getOperands(n)[0]), getType(n), "casttmp");
+    }
+    llvm_unreachable("Unknown ExprAST kind");
 }
 
-Value* CodeGen::codegen(FloatLitExprAST *ast)
+Type* CodeGen::getType(FlatAST::Node n)
 {
-    return ConstantFP::get(getGlobalContext(), APFloat(ast->val));
+    return FlatAST::getLLVMType(body->getType(n), builder.getContext());
 }
 
-Value* CodeGen::codegen(BoolLitExprAST *ast)
+Value* CodeGen::createStringLit(FlatAST::Node n)
 {
-    if (ast->val)
-        return ConstantInt::getTrue(getGlobalContext());
-    else
-        return ConstantInt::getFalse(getGlobalContext());
-}
+    // Laid out like the StringRuntime's strings, the length comes right before the characters
+    StringRef str = body->getString(n);
+    auto id = stringIds.insert(std::make_pair(str, (unsigned)stringIds.size())).first;
+    std::string name = "__ls_string_" + std::to_string(id->second);
+    Module* module = builder.GetInsertBlock()->getParent()->getParent();
+    GlobalVariable* gv = module->getNamedGlobal(name);
+    if (!gv)
+    {
+        Constant* fields[] = {builder.getInt64(str.size()),
+                              ConstantDataArray::getString(builder.getContext(), str)};
+        Constant* init = ConstantStruct::getAnon(fields);
+        gv = new GlobalVariable(*module, init->getType(), true, GlobalValue::PrivateLinkage, init, name);
+        gv->setUnnamedAddr(true);
+        gv->setAlignment(8);
+    }
 
-Value* CodeGen::codegen(StringLitExprAST *ast)
-{
-    return builder.CreateGlobalStringPtr(ast->str, "stringlit");
-}
-Value* CodeGen::codegen(VariableExprAST* ast)
-{
-    // Look this variable up in the function.
-    Value *v = symbols[ast->name];
-    return v ? v : errorV(("Unknown variable name: "+ast->name).c_str());
+    Constant* indices[] = {builder.getInt32(0), builder.getInt32(1), builder.getInt32(0)};
+    return ConstantExpr::getInBoundsGetElementPtr(gv, indices);
 }
 
-Value* CodeGen::codegen(BinaryExprAST* ast)
+Value* CodeGen::createBinary(FlatAST::Node n)
 {
-    Value *l = ast->lhs->codegen(*this);
-    Value *r = ast->rhs->codegen(*this);
-    if (l == 0 || r == 0)
-        return 0;
-
-    // Perform type casts if necessary
-    Type *intType = builder.getInt64Ty(),
-            *floatType = builder.getDoubleTy(),
-            *boolType = builder.getInt1Ty(),
-            *stringType = builder.getInt8PtrTy();
-
-    if (l->getType() != r->getType())
-    {
-        if (l->getType() == stringType || r->getType() == stringType)
-            return errorV("Invalid binary expression,  no cast from or to 'string' exists");
-        else if (l->getType() == floatType)
-            r = builder.CreateUIToFP(r, floatType, "casttmp");
-        else if (r->getType() == floatType)
-            l = builder.CreateUIToFP(l, floatType, "casttmp");
-    }
-
-    switch (ast->op)
+    ArrayRef<FlatAST::Node> ops = body->getOperands(n);
+    Value *l = codegen(ops[0]);
+    Value *r = codegen(ops[1]);
+
+    // Both sides have the same type, the TypeChecker inserted any casts needed
+    char op = body->getOp(n);
+    if (body->getType(ops[0]) == FlatAST::StringType)
+        return createStringOp(op, l, r);
+    bool isFloat = body->getType(ops[0]) == FlatAST::FloatType;
+    switch (op)
     {
         case '+':
-            if (l->getType() == floatType)
-                return builder.CreateFAdd(l, r, "addtmp");
-            else if (l->getType() == intType || l->getType() == boolType)
-                return builder.CreateAdd(l, r, "addtmp");
-            else
-                return errorV("Internal error in CodeGen::codegen(BinaryExprAST*)");
+            return isFloat ? builder.CreateFAdd(l, r, "addtmp") : builder.CreateAdd(l, r, "addtmp");
         case '-':
-            if (l->getType() == floatType)
-                return builder.CreateFSub(l, r, "subtmp");
-            else if (l->getType() == intType || l->getType() == boolType)
-                return builder.CreateSub(l, r, "subtmp");
-            else
-                return errorV("Internal error in CodeGen::codegen(BinaryExprAST*)");
+            return isFloat ? builder.CreateFSub(l, r, "subtmp") : builder.CreateSub(l, r, "subtmp");
         case '*':
-            if (l->getType() == floatType)
-                return builder.CreateFMul(l, r, "multmp");
-            else if (l->getType() == intType || l->getType() == boolType)
-                return builder.CreateMul(l, r, "multmp");
-            else
-                return errorV("Internal error in CodeGen::codegen(BinaryExprAST*)");
+            return isFloat ? builder.CreateFMul(l, r, "multmp") : builder.CreateMul(l, r, "multmp");
         case '<':
-            if (l->getType() == floatType)
-                builder.CreateFCmpULT(l, r, "cmptmp");
-            else if (l->getType() == intType || l->getType() == boolType)
-                return builder.CreateICmpSLT(l, r, "cmptmp");
-            else
-                return errorV("Internal error in CodeGen::codegen(BinaryExprAST*)");
+            return isFloat ? builder.CreateFCmpULT(l, r, "cmptmp") : builder.CreateICmpSLT(l, r, "cmptmp");
         default:
-            return errorV("invalid binary operator");
+            llvm_unreachable("Invalid binary operator");
     }
 }
 
-Value* CodeGen::codegen(CallExprAST *ast)
+Value* CodeGen::createCall(FlatAST::Node n)
 {
     // Look up the name in the global module table.
-    Function *calleeF = jit->getFunction(ast->callee);
-    if (calleeF == 0)
-        return errorV(("Unknown function referenced: "+ast->callee).c_str());
-
-    // If argument mismatch error.
-    if (calleeF->arg_size() != ast->args.size())
-        return errorV(("Incorrect number of arguments passed to "+ast->callee).c_str());
-
-    auto it = calleeF->getArgumentList().begin();
-    std::vector<Value*> argsV;
-    for (unsigned i = 0, e = ast->args.size(); i != e; ++i)
-    {
-
-        Value* argV = ast->args[i]->codegen(*this);
-        if (argV->getType() != it->getType())
-            return errorV(("Incorrect argument type for argument "
-                           +std::to_string(i+1)+" in function call of "+ast->callee).c_str());
-        else
-            it++;
-        argsV.push_back(argV);
-        if (argsV.back() == 0)
-            return 0;
-    }
-
-    return builder.CreateCall(calleeF, argsV, "calltmp");
+    StringRef callee = body->getString(n);
+    Function *calleeF = jit->getFunction(callee);
+    assert(calleeF && "Calls are resolved by the TypeChecker");
+
+    SmallVector<Value*, 8> argsV;
+    for (FlatAST::Node arg : body->getOperands(n))
+        argsV.push_back(codegen(arg));
+
+    // Void values can't be named
+    const char* name = calleeF->getReturnType()->isVoidTy() ? "" : "calltmp";
+    if (jit->isLazyCallTarget(callee))
+        return createLazyCall(calleeF, argsV, name);
+    return builder.CreateCall(calleeF, argsV, name);
 }
 
-Value* CodeGen::codegen(VoidExprAST*)
+Value* CodeGen::createLazyCall(Function* calleeF, ArrayRef<Value*> args, const char* name)
 {
-    BasicBlock* target = BasicBlock::Create(getGlobalContext(), "nop", builder.GetInsertBlock()->getParent());
-    Value* r = builder.CreateBr(target);
-    builder.SetInsertPoint(target);
-    return r;
+    // Load the callee's address from its stub, it's null until the first call compiles it
+    GlobalVariable* stub = jit->getLazyStub(calleeF->getName());
+    Value* addrV = builder.CreateLoad(stub, "lazyaddr");
+
+    Function *function = builder.GetInsertBlock()->getParent();
+    BasicBlock *loadBB = builder.GetInsertBlock();
+    BasicBlock *compileBB = BasicBlock::Create(builder.getContext(), "lazycompile", function);
+    BasicBlock *callBB = BasicBlock::Create(builder.getContext(), "lazycall", function);
+
+    // Only the very first call takes the slow path
+    MDNode* weights = MDBuilder(builder.getContext()).createBranchWeights(1, 1000);
+    builder.CreateCondBr(builder.CreateIsNull(addrV), compileBB, callBB, weights);
+
+    builder.SetInsertPoint(compileBB);
+    Value* compiledV = builder.CreateCall(jit->getLazyCompileFunction(),
+                                          builder.CreateBitCast(stub, builder.getInt8PtrTy()),
+                                          "lazycompiled");
+    builder.CreateBr(callBB);
+
+    builder.SetInsertPoint(callBB);
+    PHINode *pn = builder.CreatePHI(builder.getInt8PtrTy(), 2, "lazytarget");
+    pn->addIncoming(addrV, loadBB);
+    pn->addIncoming(compiledV, compileBB);
+    Value* targetV = builder.CreateBitCast(pn, calleeF->getFunctionType()->getPointerTo());
+    return builder.CreateCall(targetV, args, name);
 }
 
-Value* CodeGen::codegen(UnaryExprAST* ast)
+Value* CodeGen::createStringOp(char op, Value* l, Value* r)
 {
-    Value *r = ast->rhs->codegen(*this);
-    if (r == 0)
-        return 0;
-
-    switch (ast->op)
+    Module* module = builder.GetInsertBlock()->getParent()->getParent();
+    Type* stringTy = builder.getInt8PtrTy();
+    Value* args[] = {l, r};
+    if (op == '+')
     {
-        case '+': return r;
-        case '-': return builder.CreateNeg(r, "negtmp");
-        default: return errorV("invalid unary operator");
+        Constant* concatF = module->getOrInsertFunction("__ls_string_concat", stringTy, stringTy, stringTy, nullptr);
+        return builder.CreateCall(concatF, args, "concattmp");
     }
+
+    Constant* compareF = module->getOrInsertFunction("__ls_string_compare", builder.getInt64Ty(),
+                                                     stringTy, stringTy, nullptr);
+    return builder.CreateICmpSLT(builder.CreateCall(compareF, args, "comparetmp"), builder.getInt64(0), "cmptmp");
 }
 
-Value* CodeGen::codegen(SequenceExprAST* ast)
+Value* CodeGen::createCycleCount()
 {
-    Value *l = ast->lhs->codegen(*this);
-    Value *r = ast->rhs->codegen(*this);
-    if (l == 0 || r == 0)
-        return 0;
+    // rdtsc on x86, a fallback on the other targets
+    Module* module = builder.GetInsertBlock()->getParent()->getParent();
+    return builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::readcyclecounter), "cycles");
+}
 
-    return r;
+void CodeGen::createExitProbe(uint32_t id, Value* startV)
+{
+    Value* cyclesV = builder.CreateSub(createCycleCount(), startV, "elapsed");
+
+    // Both are resolved by the jit, like the lazy stubs
+    Module* module = builder.GetInsertBlock()->getParent()->getParent();
+    Constant* profilerV = module->getOrInsertGlobal("__ls_profiler", builder.getInt8Ty());
+    Constant* recordF = module->getOrInsertFunction("__ls_profile", builder.getVoidTy(), builder.getInt8PtrTy(),
+                                                    builder.getInt32Ty(), builder.getInt64Ty(), nullptr);
+    Value* args[] = {profilerV, builder.getInt32(id), cyclesV};
+    builder.CreateCall(recordF, args);
 }
 
-Value* CodeGen::codegen(IfExprAST* ast)
+Value* CodeGen::createUnary(FlatAST::Node n)
 {
-    Value *condV = ast->condAST->codegen(*this);
-    if (condV == 0)
-        return 0;
+    Value *r = codegen(body->getOperands(n)[0]);
 
-    if (condV->getType() == Type::getDoubleTy(getGlobalContext()))
-    {
-        // Convert condition to a bool by comparing equal to 0.0.
-        condV = builder.CreateFCmpONE(condV,
-                        ConstantFP::get(getGlobalContext(), APFloat(0.0)),
-                        "ifcond");
-    }
-    else if (condV->getType() == Type::getInt64Ty(getGlobalContext()))
+    switch (body->getOp(n))
     {
-        // Convert condition to a bool by comparing equal to 0.
-        condV = builder.CreateICmpNE(condV,
-                        builder.getInt64(0),
-                        "ifcond");
-    }
-    else if (condV->getType() == Type::getInt1Ty(getGlobalContext()))
-    {
-        // It's already a bool
-    }
-    else
-    {
-        return errorV("Expression in if must be an int, float, or bool");
+        case '+': return r;
+        case '-':
+            if (body->getType(n) == FlatAST::FloatType)
+                return builder.CreateFNeg(r, "negtmp");
+            return builder.CreateNeg(r, "negtmp");
+        default: llvm_unreachable("Invalid unary operator");
     }
+}
+
+Value* CodeGen::createIf(FlatAST::Node n)
+{
+    ArrayRef<FlatAST::Node> ops = body->getOperands(n);
+    Value *condV = createCondition(ops[0], "ifcond");
 
     Function *function = builder.GetInsertBlock()->getParent();
 
     // Create blocks for the then and else cases.  Insert the 'then' block at the
     // end of the function.
-    BasicBlock *thenBB = BasicBlock::Create(getGlobalContext(), "then", function);
-    BasicBlock *elseBB = BasicBlock::Create(getGlobalContext(), "else");
-    BasicBlock *mergeBB = BasicBlock::Create(getGlobalContext(), "ifcont");
+    BasicBlock *thenBB = BasicBlock::Create(builder.getContext(), "then", function);
+    BasicBlock *elseBB = BasicBlock::Create(builder.getContext(), "else");
+    BasicBlock *mergeBB = BasicBlock::Create(builder.getContext(), "ifcont");
 
     builder.CreateCondBr(condV, thenBB, elseBB);
 
     // Emit then value.
     builder.SetInsertPoint(thenBB);
 
-    Value *thenV = ast->thenAST->codegen(*this);
-    if (thenV == 0)
-        return 0;
+    Value *thenV = codegen(ops[1]);
 
     builder.CreateBr(mergeBB);
     // Codegen of 'thenAST' can change the current block, update thenBB for the PHI.
@@ -221,21 +248,19 @@ Value* CodeGen::codegen(IfExprAST* ast)
     function->getBasicBlockList().push_back(elseBB);
     builder.SetInsertPoint(elseBB);
 
-    Value *elseV = ast->elseAST->codegen(*this);
-    if (elseV == 0)
-        return 0;
+    Value *elseV = codegen(ops[2]);
 
     builder.CreateBr(mergeBB);
     // Codegen of 'elseAST' can change the current block, update elseBB for the PHI.
     elseBB = builder.GetInsertBlock();
 
-    if (thenV->getType() != elseV->getType())
-        return errorV("The 'then' and 'else' expressions must return the same type");
-
     // Emit merge block.
     function->getBasicBlockList().push_back(mergeBB);
     builder.SetInsertPoint(mergeBB);
-    PHINode *pn = builder.CreatePHI(thenV->getType(),
+    if (body->getType(n) == FlatAST::VoidType)
+        return 0;
+
+    PHINode *pn = builder.CreatePHI(getType(n),
                                     2, "iftmp");
 
     pn->addIncoming(thenV, thenBB);
@@ -243,6 +268,126 @@ Value* CodeGen::codegen(IfExprAST* ast)
     return pn;
 }
 
+Value* CodeGen::createWhile(FlatAST::Node n)
+{
+    ArrayRef<FlatAST::Node> ops = body->getOperands(n);
+    Function *function = builder.GetInsertBlock()->getParent();
+    BasicBlock *condBB = BasicBlock::Create(builder.getContext(), "whilecond", function);
+    BasicBlock *bodyBB = BasicBlock::Create(builder.getContext(), "whilebody");
+    BasicBlock *afterBB = BasicBlock::Create(builder.getContext(), "afterwhile");
+
+    // Canonical form: the current block is the preheader, the condition block the header,
+    // the end of the body the only latch and afterwhile the only exit. Loop rotation does the rest.
+    builder.CreateBr(condBB);
+    builder.SetInsertPoint(condBB);
+    builder.CreateCondBr(createCondition(ops[0], "whilecond"), bodyBB, afterBB);
+
+    function->getBasicBlockList().push_back(bodyBB);
+    builder.SetInsertPoint(bodyBB);
+    codegen(ops[1]);
+    builder.CreateBr(condBB);
+
+    function->getBasicBlockList().push_back(afterBB);
+    builder.SetInsertPoint(afterBB);
+    return 0;
+}
+
+Value* CodeGen::createFor(FlatAST::Node n)
+{
+    // The range is evaluated once, before the loop
+    ArrayRef<FlatAST::Node> ops = body->getOperands(n);
+    StringRef varName = body->getString(n);
+    Value *startV = codegen(ops[0]);
+    Value *endV = codegen(ops[1]);
+
+    Function *function = builder.GetInsertBlock()->getParent();
+    BasicBlock *preheaderBB = BasicBlock::Create(builder.getContext(), "forpreheader", function);
+    BasicBlock *loopBB = BasicBlock::Create(builder.getContext(), "forbody");
+    BasicBlock *exitBB = BasicBlock::Create(builder.getContext(), "forexit");
+    BasicBlock *afterBB = BasicBlock::Create(builder.getContext(), "afterfor");
+
+    // Already rotated: a guard skips empty ranges, and the latch tests the next value.
+    // The loop has a preheader, a single latch and a dedicated exit, like after LoopSimplify.
+    builder.CreateCondBr(builder.CreateICmpSLT(startV, endV, "forguard"), preheaderBB, afterBB);
+    builder.SetInsertPoint(preheaderBB);
+    builder.CreateBr(loopBB);
+
+    function->getBasicBlockList().push_back(loopBB);
+    builder.SetInsertPoint(loopBB);
+    PHINode *varPN = builder.CreatePHI(builder.getInt64Ty(), 2, varName);
+    varPN->addIncoming(startV, preheaderBB);
+
+    // The variable shadows an argument with the same name in the body
+    auto shadowed = symbols.find(varName);
+    Value *shadowedV = shadowed != symbols.end() ? shadowed->second : 0;
+    symbols[varName] = varPN;
+    codegen(ops[2]);
+    if (shadowedV)
+        symbols[varName] = shadowedV;
+    else
+        symbols.erase(varName);
+
+    // var < end, so var+1 can't overflow
+    Value *nextV = builder.CreateNSWAdd(varPN, builder.getInt64(1), "nextvar");
+    varPN->addIncoming(nextV, builder.GetInsertBlock());
+    builder.CreateCondBr(builder.CreateICmpSLT(nextV, endV, "forcond"), loopBB, exitBB);
+
+    function->getBasicBlockList().push_back(exitBB);
+    builder.SetInsertPoint(exitBB);
+    builder.CreateBr(afterBB);
+
+    function->getBasicBlockList().push_back(afterBB);
+    builder.SetInsertPoint(afterBB);
+    return 0;
+}
+
+Value* CodeGen::createVar(FlatAST::Node n)
+{
+    // Allocas at the top of the entry block are promoted to SSA values by SROA,
+    // which also makes the values carried by loops into phis
+    Value *initV = codegen(body->getOperands(n)[0]);
+    BasicBlock& entryBB = builder.GetInsertBlock()->getParent()->getEntryBlock();
+    IRBuilder<> entryBuilder(&entryBB, entryBB.begin());
+    AllocaInst *alloca = entryBuilder.CreateAlloca(initV->getType(), 0, body->getString(n));
+    builder.CreateStore(initV, alloca);
+
+    // The TypeChecker doesn't let vars shadow another variable, nothing to restore
+    symbols[body->getString(n)] = alloca;
+    return 0;
+}
+
+Value* CodeGen::createVariable(FlatAST::Node n)
+{
+    // The TypeChecker already resolved all the variables
+    StringRef name = body->getString(n);
+    Value *v = symbols[name];
+    if (isa<AllocaInst>(v))
+        return builder.CreateLoad(v, name);
+    return v;
+}
+
+Value* CodeGen::createCondition(FlatAST::Node cond, const char* name)
+{
+    Value *condV = codegen(cond);
+
+    FlatAST::TypeTag condType = body->getType(cond);
+    if (condType == FlatAST::FloatType)
+    {
+        // Convert condition to a bool by comparing equal to 0.0.
+        condV = builder.CreateFCmpONE(condV,
+                        ConstantFP::get(builder.getContext(), APFloat(0.0)),
+                        name);
+    }
+    else if (condType == FlatAST::IntType)
+    {
+        // Convert condition to a bool by comparing equal to 0.
+        condV = builder.CreateICmpNE(condV,
+                        builder.getInt64(0),
+                        name);
+    }
+    return condV;
+}
+
 Function* CodeGen::codegen(PrototypeAST* ast)
 {
     // Make the function type:  double(double,double) etc.
@@ -252,27 +397,14 @@ Function* CodeGen::codegen(PrototypeAST* ast)
 
     Function *f = Function::Create(ft, Function::ExternalLinkage, ast->name, m);
 
-    // If F conflicted, there was already something named 'Name'.  If it has a
-    // body, don't allow redefinition or reextern.
+    // If F conflicted, there was already something named 'Name'.
+    // The TypeChecker already rejected prototypes that don't match it.
     if (f->getName() != ast->name)
     {
         // Delete the one we just made and get the existing one.
         f->eraseFromParent();
         f = jit->getFunction(ast->name);
-
-        // If F already has a body, reject this.
-        if (!f->empty())
-        {
-            errorF("redefinition of function");
-            return 0;
-        }
-
-        // If F took a different number of args, reject.
-        if (f->arg_size() != ast->argNames.size())
-        {
-            errorF("redefinition of function with different # args");
-            return 0;
-        }
+        assert(f->arg_size() == ast->argNames.size() && "Prototypes are checked by the TypeChecker");
     }
 
     // Set names for all arguments.
@@ -289,42 +421,49 @@ Function* CodeGen::codegen(PrototypeAST* ast)
 }
 
 Function* CodeGen::codegen(FunctionAST* ast)
+{
+    flatBody.clear();
+    flatBody.emit(ast->body);
+    return codegen(ast->proto, flatBody);
+}
+
+Function* CodeGen::codegen(PrototypeAST* proto, const FlatAST& flat)
 {
     symbols.clear();
 
-    Function *function = codegen(ast->proto);
-    if (function == 0)
-        return 0;
+    Function *function = codegen(proto);
+    assert(function->empty() && "Redefinitions are rejected by the TypeChecker");
 
     // Create a new basic block to start insertion into.
-    BasicBlock *bb = BasicBlock::Create(getGlobalContext(), "entry", function);
+    BasicBlock *bb = BasicBlock::Create(builder.getContext(), "entry", function);
     builder.SetInsertPoint(bb);
 
-    if (Value *retVal = ast->body->codegen(*this))
+    // Without a profiler, functions don't have any probes at all
+    Profiler* profiler = jit->getProfiler();
+    uint32_t probeId = 0;
+    Value* startV = 0;
+    if (profiler)
     {
-        // Finish off the function.
-        if (ast->proto->retType->isVoidTy())
-        {
-            if (retVal && retVal->getType() != Type::getVoidTy(getGlobalContext()))
-                fprintf(stderr, "Warning: Non-void return value in void function '%s'\n", ast->proto->name.c_str());
-            builder.CreateRetVoid();
-        }
-        else
-        {
-            if (retVal->getType() != ast->proto->retType)
-                return errorF(("Return value type doesn't match"
-                              " function prototype in '"
-                              +ast->proto->name+"'\n").c_str());
-            builder.CreateRet(retVal);
-        }
+        probeId = profiler->addFunction(proto->name.str());
+        startV = createCycleCount();
+    }
 
-        // Validate the generated code, checking for consistency.
-        verifyFunction(*function);
+    // The TypeChecker validated the body, it can't fail
+    body = &flat;
+    Value *retVal = codegen(flat.getRoot());
 
-        return function;
-    }
+    // Functions have a single return, at the end
+    if (startV)
+        createExitProbe(probeId, startV);
 
-    // Error reading body, remove function.
-    function->eraseFromParent();
-    return 0;
+    // Finish off the function.
+    if (proto->retType->isVoidTy())
+        builder.CreateRetVoid();
+    else
+        builder.CreateRet(retVal);
+
+    // Validate the generated code, checking for consistency.
+    verifyFunction(*function);
+
+    return function;
 }
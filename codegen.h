@@ -4,35 +4,56 @@
 #include <llvm/IR/Value.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Module.h>
+#include <llvm/ADT/StringMap.h>
 #include <map>
 #include <string>
 #include "exprast.h"
+#include "flatast.h"
 
 class MCJITHelper;
 
 class CodeGen
 {
 public:
-    CodeGen(MCJITHelper* Jit);
+    CodeGen(MCJITHelper* Jit, llvm::LLVMContext& Context);
     ~CodeGen();
 
-    llvm::Value* codegen(IntLitExprAST *ast);
-    llvm::Value* codegen(FloatLitExprAST* ast);
-    llvm::Value* codegen(StringLitExprAST* ast);
-    llvm::Value* codegen(BoolLitExprAST* ast);
-    llvm::Value* codegen(VariableExprAST* ast);
-    llvm::Value* codegen(BinaryExprAST *ast);
-    llvm::Value* codegen(CallExprAST* ast);
-    llvm::Value* codegen(VoidExprAST* ast);
-    llvm::Value* codegen(UnaryExprAST* ast);
-    llvm::Value* codegen(SequenceExprAST* ast);
-    llvm::Value* codegen(IfExprAST* ast);
     llvm::Function* codegen(PrototypeAST* ast);
+    /// Flattens the body in a FlatAST and generates it. The AST must have been checked by the TypeChecker,
+    /// so lowering can't fail.
     llvm::Function* codegen(FunctionAST* ast);
 
+private:
+    llvm::Function* codegen(PrototypeAST* proto, const FlatAST& flat);
+    /// Dispatches on the node's kind. The value of a void expression may be null.
+    llvm::Value* codegen(FlatAST::Node n);
+    llvm::Value* createStringLit(FlatAST::Node n);
+    llvm::Value* createUnary(FlatAST::Node n);
+    llvm::Value* createBinary(FlatAST::Node n);
+    llvm::Value* createCall(FlatAST::Node n);
+    llvm::Value* createIf(FlatAST::Node n);
+    llvm::Value* createWhile(FlatAST::Node n);
+    llvm::Value* createFor(FlatAST::Node n);
+    llvm::Value* createVar(FlatAST::Node n);
+    llvm::Value* createVariable(FlatAST::Node n);
+    llvm::Type* getType(FlatAST::Node n);
+    /// Calls a function whose module isn't compiled yet through its lazy stub
+    llvm::Value* createLazyCall(llvm::Function* calleeF, llvm::ArrayRef<llvm::Value*> args, const char* name);
+    /// Converts an int, float or bool condition to an i1 by comparing it to 0
+    llvm::Value* createCondition(FlatAST::Node cond, const char* name);
+    /// Concatenation or ordering, through the StringRuntime
+    llvm::Value* createStringOp(char op, llvm::Value* l, llvm::Value* r);
+    llvm::Value* createCycleCount();
+    /// Records a call of the function with its id in the profiler, and the cycles elapsed since startV
+    void createExitProbe(uint32_t id, llvm::Value* startV);
+
 private:
     llvm::IRBuilder<> builder;
-    std::map<std::string, llvm::Value*> symbols;
+    /// Keys are views into the script. Vars are bound to their alloca, the other variables to their value.
+    std::map<llvm::StringRef, llvm::Value*> symbols;
+    llvm::StringMap<unsigned> stringIds; ///< Identical literals of a module share one global
+    FlatAST flatBody; ///< Reused by every definition
+    const FlatAST* body; ///< Of the function being generated
     MCJITHelper* jit;
 };
 
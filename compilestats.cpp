@@ -0,0 +1,43 @@
+#include "compilestats.h"
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+
+BackendStats& BackendStats::operator+=(const BackendStats& other)
+{
+    functionPassTime += other.functionPassTime;
+    modulePassTime += other.modulePassTime;
+    codegenTime += other.codegenTime;
+    finalizeTime += other.finalizeTime;
+    modules += other.modules;
+    irInstructionsBefore += other.irInstructionsBefore;
+    irInstructionsAfter += other.irInstructionsAfter;
+    codeBytes += other.codeBytes;
+    return *this;
+}
+
+std::string CompileStats::toJSON() const
+{
+    std::string json;
+    raw_string_ostream out{json};
+    out << "{\"frontend\": {"
+        << "\"lexTime\": " << format("%.6f", frontend.lexTime)
+        << ", \"parseTime\": " << format("%.6f", frontend.parseTime)
+        << ", \"checkTime\": " << format("%.6f", frontend.checkTime)
+        << ", \"irgenTime\": " << format("%.6f", frontend.irgenTime)
+        << ", \"tokens\": " << frontend.tokens
+        << ", \"astNodes\": " << frontend.astNodes
+        << ", \"functions\": " << frontend.functions
+        << "}, \"backend\": {"
+        << "\"functionPassTime\": " << format("%.6f", backend.functionPassTime)
+        << ", \"modulePassTime\": " << format("%.6f", backend.modulePassTime)
+        << ", \"codegenTime\": " << format("%.6f", backend.codegenTime)
+        << ", \"finalizeTime\": " << format("%.6f", backend.finalizeTime)
+        << ", \"modules\": " << backend.modules
+        << ", \"irInstructionsBefore\": " << backend.irInstructionsBefore
+        << ", \"irInstructionsAfter\": " << backend.irInstructionsAfter
+        << ", \"codeBytes\": " << backend.codeBytes
+        << "}}";
+    return out.str();
+}
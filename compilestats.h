@@ -0,0 +1,61 @@
+#ifndef COMPILESTATS_H
+#define COMPILESTATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/// Lexing, parsing and IR generation of a script. Times are in seconds.
+struct FrontendStats
+{
+    double lexTime = 0;
+    double parseTime = 0;
+    double checkTime = 0; ///< Type checking and simplification
+    double irgenTime = 0;
+    uint64_t tokens = 0;
+    uint64_t astNodes = 0;
+    uint64_t functions = 0;
+};
+
+/// Optimization and machine code generation, summed over every module the JIT compiled.
+/// Modules compiled in parallel add up their own times, so these can exceed the wall time.
+/// Optimization is timed per pipeline, not per pass: -time-passes breaks it down further.
+struct BackendStats
+{
+    double functionPassTime = 0; ///< The whole function pass pipeline
+    double modulePassTime = 0; ///< The whole module pass pipeline, inlining and loop passes included
+    double codegenTime = 0;
+    double finalizeTime = 0; ///< Linking and making the code executable
+    uint64_t modules = 0;
+    uint64_t irInstructionsBefore = 0; ///< Before optimization
+    uint64_t irInstructionsAfter = 0;
+    uint64_t codeBytes = 0;
+
+    BackendStats& operator+=(const BackendStats& other);
+};
+
+/// Where the compile time of a script went, and how much code went through each phase
+struct CompileStats
+{
+    FrontendStats frontend;
+    BackendStats backend;
+
+    std::string toJSON() const;
+};
+
+/// Adds the seconds elapsed during its lifetime to a phase's time
+class PhaseTimer
+{
+public:
+    PhaseTimer(double& total) : total(total), start{std::chrono::steady_clock::now()} {}
+    ~PhaseTimer()
+    {
+        total += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    double& total;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif // COMPILESTATS_H
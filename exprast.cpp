@@ -1,7 +1,9 @@
 #include "exprast.h"
-#include "codegen.h"
 #include "tokenizer.h"
 #include <cstdlib>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/DerivedTypes.h>
 
 using namespace llvm;
 
@@ -10,78 +12,39 @@ ExprAST *ASTParser::error(const char *str) { fprintf(stderr, "Error on line %li:
 PrototypeAST *ASTParser::errorP(const char *str) { error(str); return 0; }
 FunctionAST *ASTParser::errorF(const char *str) { error(str); return 0; }
 
-ExprAST::ExprAST()
+ASTParser::ASTParser(Tokenizer& Tokenizer, LLVMContext& Context)
+    : tokenizer{Tokenizer}, context(Context), nodeCount{0}
 {
 }
 
-ExprAST::~ExprAST()
+void ASTParser::releaseAST()
 {
+    arena.reset();
 }
 
-ASTParser::ASTParser(Tokenizer& Tokenizer)
-    : tokenizer{Tokenizer}
+ASTArena& ASTParser::getArena()
 {
+    return arena;
 }
 
-Value* IntLitExprAST::codegen(CodeGen &gen)
+uint64_t ASTParser::getNodeCount() const
 {
-    return gen.codegen(this);
+    return nodeCount;
 }
 
-Value* FloatLitExprAST::codegen(CodeGen &gen)
+template <class T, class... Args>
+T* ASTParser::create(Args&&... args)
 {
-    return gen.codegen(this);
-}
-
-Value* StringLitExprAST::codegen(CodeGen &gen)
-{
-    return gen.codegen(this);
-}
-
-Value* BoolLitExprAST::codegen(CodeGen &gen)
-{
-    return gen.codegen(this);
-}
-
-Value* VariableExprAST::codegen(CodeGen &gen)
-{
-    return gen.codegen(this);
-}
-
-Value* BinaryExprAST::codegen(CodeGen &gen)
-{
-    return gen.codegen(this);
-}
-
-Value* CallExprAST::codegen(CodeGen &gen)
-{
-    return gen.codegen(this);
-}
-
-Value* VoidExprAST::codegen(CodeGen &gen)
-{
-    return gen.codegen(this);
-}
-
-Value* UnaryExprAST::codegen(CodeGen &gen)
-{
-    return gen.codegen(this);
-}
-
-Value* SequenceExprAST::codegen(CodeGen &gen)
-{
-    return gen.codegen(this);
-}
-
-Value* IfExprAST::codegen(CodeGen &gen)
-{
-    return gen.codegen(this);
+    T* node = arena.make<T>(std::forward<Args>(args)...);
+    node->line = tokenizer.getCurLine();
+    ++nodeCount;
+    return node;
 }
 
 /// numberexpr ::= number
 ExprAST* ASTParser::parseIntLitExpr()
 {
-    ExprAST *result = new IntLitExprAST(tokenizer.getCurIntLiteral());
+    ExprAST *result = create<IntLitExprAST>(tokenizer.getCurIntLiteral());
     tokenizer.getNextToken(); // consume the number
     return result;
 }
@@ -89,7 +52,7 @@ ExprAST* ASTParser::parseIntLitExpr()
 /// numberexpr ::= number
 ExprAST* ASTParser::parseFloatLitExpr()
 {
-    ExprAST *result = new FloatLitExprAST(tokenizer.getCurFloatLiteral());
+    ExprAST *result = create<FloatLitExprAST>(tokenizer.getCurFloatLiteral());
     tokenizer.getNextToken(); // consume the number
     return result;
 }
@@ -97,7 +60,7 @@ ExprAST* ASTParser::parseFloatLitExpr()
 /// stringexpr ::= '"' string '"'
 ExprAST* ASTParser::parseStringLitExpr()
 {
-    ExprAST *result = new StringLitExprAST(tokenizer.getCurIdentifier());
+    ExprAST *result = create<StringLitExprAST>(tokenizer.getCurIdentifier());
     tokenizer.getNextToken(); // consume the string
     return result;
 }
@@ -105,7 +68,7 @@ ExprAST* ASTParser::parseStringLitExpr()
 /// boolexpr ::= true
 ExprAST* ASTParser::parseBoolLitExpr()
 {
-    ExprAST *result = new BoolLitExprAST((tokenizer.getCurToken()==tok_true));
+    ExprAST *result = create<BoolLitExprAST>((tokenizer.getCurToken()==tok_true));
     tokenizer.getNextToken(); // consume the bool
     return result;
 }
@@ -125,19 +88,29 @@ ExprAST* ASTParser::parseParenExpr()
 
 /// identifierexpr
 ///   ::= identifier
+///   ::= identifier '=' expression
 ///   ::= identifier '(' expression* ')'
 ExprAST* ASTParser::parseIdentifierExpr()
 {
-    std::string idName = tokenizer.getCurIdentifier();
+    StringRef idName = tokenizer.getCurIdentifier();
 
     Token curTok = tokenizer.getNextToken();  // eat identifier
 
+    if ((char)curTok == '=')
+    {
+        tokenizer.getNextToken();  // eat '='
+        ExprAST *valueAST = parseExpression();
+        if (!valueAST)
+            return error("Invalid assigned value");
+        return create<AssignExprAST>(idName, valueAST);
+    }
+
     if ((char)curTok != '(') // Simple variable ref
-        return new VariableExprAST(idName);
+        return create<VariableExprAST>(idName);
 
     // Call
     curTok = tokenizer.getNextToken();  // eat (
-    std::vector<ExprAST*> args;
+    SmallVector<ExprAST*, 8> args;
     if ((char)curTok != ')')
     {
         while (1)
@@ -160,7 +133,7 @@ ExprAST* ASTParser::parseIdentifierExpr()
     // Eat the ')'.
     tokenizer.getNextToken();
 
-    return new CallExprAST(idName, args);
+    return create<CallExprAST>(idName, arena.copy(args));
 }
 
 /// primary
@@ -181,10 +154,13 @@ ExprAST* ASTParser::parsePrimary()
     case tok_false:
     case tok_true:           return parseBoolLitExpr();
     case tok_if:             return parseIfExpr();
+    case tok_while:          return parseWhileExpr();
+    case tok_for:            return parseForExpr();
+    case tok_var:            return parseVarExpr();
     case '(':                return parseParenExpr();
     case '+':
     case '-':                return parseUnaryExpr();
-    case '}':                return new VoidExprAST;
+    case '}':                return create<VoidExprAST>();
     }
 }
 
@@ -199,7 +175,7 @@ ExprAST* ASTParser::parseUnaryExpr()
     if (!rhs)
         return 0;
 
-    return new UnaryExprAST(op, rhs);
+    return create<UnaryExprAST>(op, rhs);
 }
 
 /// expression
@@ -249,7 +225,7 @@ ExprAST* ASTParser::parseBinOpRHS(int exprPrec, ExprAST *lhs)
         }
 
         // Merge LHS/RHS.
-        lhs = new BinaryExprAST(binOp, lhs, rhs);
+        lhs = create<BinaryExprAST>(binOp, lhs, rhs);
     }
 }
 
@@ -268,7 +244,7 @@ ExprAST* ASTParser::parseIfExpr()
     return error("Invalid then expression");
 
     if (tokenizer.getCurToken() != tok_else)
-        return new IfExprAST(condAST, thenAST, new VoidExprAST);
+        return create<IfExprAST>(condAST, thenAST, create<VoidExprAST>());
     else
         tokenizer.getNextToken();
 
@@ -276,7 +252,74 @@ ExprAST* ASTParser::parseIfExpr()
     if (!elseAST)
         return error("Invalid else expression");
 
-    return new IfExprAST(condAST, thenAST, elseAST);
+    return create<IfExprAST>(condAST, thenAST, elseAST);
+}
+
+/// whileexpr ::= 'while' expression block
+ExprAST* ASTParser::parseWhileExpr()
+{
+    tokenizer.getNextToken();  // eat the while.
+
+    ExprAST *condAST = parseExpression();
+    if (!condAST)
+        return error("Invalid while condition");
+
+    ExprAST *bodyAST = parseBlock();
+    if (!bodyAST)
+        return error("Invalid while body");
+
+    return create<WhileExprAST>(condAST, bodyAST);
+}
+
+/// forexpr ::= 'for' identifier '=' expression ',' expression block
+ExprAST* ASTParser::parseForExpr()
+{
+    tokenizer.getNextToken();  // eat the for.
+
+    if (tokenizer.getCurToken() != tok_identifier)
+        return error("Expected identifier after for");
+    StringRef varName = tokenizer.getCurIdentifier();
+
+    if ((char)tokenizer.getNextToken() != '=')
+        return error("Expected '=' after the for variable");
+    tokenizer.getNextToken();  // eat '='
+
+    ExprAST *startAST = parseExpression();
+    if (!startAST)
+        return error("Invalid for start value");
+    if ((char)tokenizer.getCurToken() != ',')
+        return error("Expected ',' after the for start value");
+    tokenizer.getNextToken();  // eat ','
+
+    ExprAST *endAST = parseExpression();
+    if (!endAST)
+        return error("Invalid for end value");
+
+    ExprAST *bodyAST = parseBlock();
+    if (!bodyAST)
+        return error("Invalid for body");
+
+    return create<ForExprAST>(varName, startAST, endAST, bodyAST);
+}
+
+/// varexpr ::= 'var' identifier '=' expression
+ExprAST* ASTParser::parseVarExpr()
+{
+    tokenizer.getNextToken();  // eat the var.
+
+    if (tokenizer.getCurToken() != tok_identifier)
+        return error("Expected identifier after var");
+    StringRef varName = tokenizer.getCurIdentifier();
+
+    if ((char)tokenizer.getNextToken() != '=')
+        return error("Expected '=' after the var name");
+    tokenizer.getNextToken();  // eat '='
+
+    ExprAST *initAST = parseExpression();
+    if (!initAST)
+        return error("Invalid var initial value");
+
+    return create<VarExprAST>(varName, initAST);
 }
 
 /// prototype
@@ -289,11 +332,11 @@ PrototypeAST* ASTParser::parsePrototype()
     switch (retTok)
     {
         default:    return errorP("Expected return type in function prototype");
-        case tok_int:    retType = Type::getInt64Ty(getGlobalContext()); break;
-        case tok_float:  retType = Type::getDoubleTy(getGlobalContext()); break;
-        case tok_string: retType = Type::getInt8PtrTy(getGlobalContext()); break;
-        case tok_bool:   retType = Type::getInt1Ty(getGlobalContext()); break;
-        case tok_void:   retType = Type::getVoidTy(getGlobalContext()); break;
+        case tok_int:    retType = Type::getInt64Ty(context); break;
+        case tok_float:  retType = Type::getDoubleTy(context); break;
+        case tok_string: retType = Type::getInt8PtrTy(context); break;
+        case tok_bool:   retType = Type::getInt1Ty(context); break;
+        case tok_void:   retType = Type::getVoidTy(context); break;
     }
 
     tokenizer.getNextToken();
@@ -301,15 +344,15 @@ PrototypeAST* ASTParser::parsePrototype()
     if (tokenizer.getCurToken() != tok_identifier)
         return errorP("Expected function name in prototype");
 
-    std::string fnName = tokenizer.getCurIdentifier();
+    StringRef fnName = tokenizer.getCurIdentifier();
     tokenizer.getNextToken();
 
     if ((char)tokenizer.getCurToken() != '(')
         return errorP("Expected '(' in prototype");
 
     // Read the list of argument names.
-    std::vector<std::string> argNames;
-    std::vector<Type*> argTypes;
+    SmallVector<StringRef, 8> argNames;
+    SmallVector<Type*, 8> argTypes;
     do {
         Type* type;
         Token typeTok = tokenizer.getNextToken();
@@ -318,10 +361,10 @@ PrototypeAST* ASTParser::parsePrototype()
         switch (typeTok)
         {
             default:         return errorP("Expected type in function prototype argument list");
-            case tok_int:    type = Type::getInt64Ty(getGlobalContext()); break;
-            case tok_float:  type = Type::getDoubleTy(getGlobalContext()); break;
-            case tok_string: type = Type::getInt8PtrTy(getGlobalContext()); break;
-            case tok_bool:   type = Type::getInt1Ty(getGlobalContext()); break;
+            case tok_int:    type = Type::getInt64Ty(context); break;
+            case tok_float:  type = Type::getDoubleTy(context); break;
+            case tok_string: type = Type::getInt8PtrTy(context); break;
+            case tok_bool:   type = Type::getInt1Ty(context); break;
             case tok_void:   return errorP("Void is not a valid type for a function argument");
         }
         Token nameTok = tokenizer.getNextToken();
@@ -337,10 +380,10 @@ PrototypeAST* ASTParser::parsePrototype()
     // success.
     tokenizer.getNextToken();  // eat ')'.
 
-    return new PrototypeAST(retType, fnName, argTypes, argNames);
+    return arena.make<PrototypeAST>(retType, fnName, arena.copy(argTypes), arena.copy(argNames));
 }
 
-/// definition ::= '{ expression* '}'
+/// block ::= '{' expression* '}'
 ExprAST* ASTParser::parseBlock()
 {
     if ((char)tokenizer.getCurToken() != '{')
@@ -348,25 +391,21 @@ ExprAST* ASTParser::parseBlock()
     else
         tokenizer.getNextToken();
 
-    ExprAST* expr = parseExpression();
-    if (!expr)
-        return error("Expected expression in block");
-    while (1)
-    {
-        if ((char)tokenizer.getCurToken() == '}')
-        {
-            tokenizer.getNextToken();
-            return expr;
-        }
-
-        ExprAST* nextExpr = parseExpression();
-        if (!nextExpr)
+    SmallVector<ExprAST*, 16> exprs;
+    do {
+        ExprAST* expr = parseExpression();
+        if (!expr)
             return error("Expected expression in block");
-        expr = new SequenceExprAST(expr, nextExpr);
-    }
+        exprs.push_back(expr);
+    } while ((char)tokenizer.getCurToken() != '}');
+    tokenizer.getNextToken(); // eat '}'
+
+    if (exprs.size() == 1)
+        return exprs.front();
+    return create<BlockExprAST>(arena.copy(exprs));
 }
 
-/// definition ::= prototype expression
+/// definition ::= prototype block
 FunctionAST* ASTParser::parseDefinition()
 {
     PrototypeAST *proto = parsePrototype();
@@ -375,26 +414,11 @@ FunctionAST* ASTParser::parseDefinition()
 
     if ((char)tokenizer.getCurToken() != '{')
         return errorF("Expected a { after function prototype");
-    else
-        tokenizer.getNextToken();
 
-    ExprAST* body = parseExpression();
+    ExprAST* body = parseBlock();
     if (!body)
         return 0;
-    while (1)
-    {
-        if ((char)tokenizer.getCurToken() == '}')
-        {
-            tokenizer.getNextToken();
-            return new FunctionAST(proto, body);
-        }
-
-        ExprAST* nextExpr = parseExpression();
-        if (!nextExpr)
-            return 0;
-        body = new SequenceExprAST(body, nextExpr);
-    }
-    return 0;
+    return arena.make<FunctionAST>(proto, body);
 }
 
 /// external ::= 'extern' prototype
@@ -410,8 +434,9 @@ FunctionAST* ASTParser::parseTopLevelExpr()
     if (ExprAST *e = parseExpression())
     {
         // Make an anonymous proto.
-        PrototypeAST *proto = new PrototypeAST(Type::getVoidTy(getGlobalContext()), "", {}, {});
-        return new FunctionAST(proto, e);
+        PrototypeAST *proto = arena.make<PrototypeAST>(Type::getVoidTy(context), "",
+                                                        ArrayRef<Type*>(), ArrayRef<StringRef>());
+        return arena.make<FunctionAST>(proto, e);
     }
     return 0;  
 }
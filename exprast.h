@@ -2,81 +2,171 @@
 #define EXPRAST_H
 
 #include <llvm/IR/Value.h>
+#include <llvm/IR/Type.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/Support/Allocator.h>
 
 #include <vector>
 #include <string>
+#include <utility>
+#include <memory>
+#include <type_traits>
 
 class Tokenizer;
 class CodeGen;
 
-/// ExprAST - Base class for all expression nodes.
+/// Bump allocator for AST nodes and their arrays.
+/// Everything is released at once by reset(), no destructor is ever run,
+/// so nodes must not own memory outside of the arena.
+class ASTArena
+{
+public:
+    template <class T, class... Args>
+    T* make(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "Arena objects are never destroyed");
+        return new (allocator.Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    /// Copies the elements of a vector into the arena
+    template <class Vector, class T = typename Vector::value_type>
+    llvm::MutableArrayRef<T> copy(const Vector& vec)
+    {
+        if (vec.empty())
+            return llvm::MutableArrayRef<T>();
+        T* data = allocator.Allocate<T>(vec.size());
+        std::uninitialized_copy(vec.begin(), vec.end(), data);
+        return llvm::MutableArrayRef<T>(data, vec.size());
+    }
+
+    void reset() { allocator.Reset(); }
+    size_t getTotalMemory() const { return allocator.getTotalMemory(); }
+
+private:
+    llvm::BumpPtrAllocator allocator;
+};
+
+/// ExprAST - Base class for all expression nodes. Nodes live in an ASTArena.
+/// There is no vtable, passes switch on the kind and llvm::isa/cast/dyn_cast work through classof.
+/// Checked bodies are flattened in a FlatAST for CodeGen.
+/// The type of each node is resolved by the TypeChecker before codegen.
 class ExprAST
 {
 public:
-    ExprAST();
-    virtual ~ExprAST();
-    virtual llvm::Value* codegen(CodeGen& gen) = 0; ///< Uses the vtable to call the right CodeGen::codegen() overload
+    enum Kind : unsigned char
+    {
+        IntLit,
+        FloatLit,
+        StringLit,
+        BoolLit,
+        Variable,
+        Void,
+        Unary,
+        Binary,
+        Block,
+        Call,
+        If,
+        While,
+        For,
+        Var,
+        Assign,
+        Cast,
+    };
+
+    ExprAST(Kind K) : kind{K}, line{0}, type{nullptr} {}
+    Kind getKind() const { return kind; }
+    unsigned getLine() const { return line; } ///< Source line the node was parsed on
+    llvm::Type* getType() const { return type; } ///< Null until the TypeChecker runs
 
-    friend class CodeGen;
+private:
+    const Kind kind;
+    unsigned line;
+    llvm::Type* type;
+
+    friend class ASTParser;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
 };
 
 /// IntLitExprAST - Expression class for integer numeric literals like 123
 class IntLitExprAST : public ExprAST {
     int64_t val;
 public:
-    IntLitExprAST(int64_t Val) : val(Val) {}
+    IntLitExprAST(int64_t Val) : ExprAST{IntLit}, val(Val) {}
+    int64_t getValue() const { return val; }
 
-    virtual llvm::Value* codegen(CodeGen& gen);
+    static bool classof(const ExprAST* e) { return e->getKind() == IntLit; }
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
 /// FloatLitExprAST - Expression class for numeric literals like 12.50
 class FloatLitExprAST : public ExprAST {
     double val;
 public:
-    FloatLitExprAST(double Val) : val(Val) {}
+    FloatLitExprAST(double Val) : ExprAST{FloatLit}, val(Val) {}
+    double getValue() const { return val; }
 
-    virtual llvm::Value* codegen(CodeGen& gen);
+    static bool classof(const ExprAST* e) { return e->getKind() == FloatLit; }
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
 /// StringLitExprAST - Expression class for string literals like "abc"
 class StringLitExprAST : public ExprAST {
-    std::string str;
+    llvm::StringRef str; ///< View into the script
 public:
-    StringLitExprAST(const std::string& Str) : str(Str) {}
+    StringLitExprAST(llvm::StringRef Str) : ExprAST{StringLit}, str(Str) {}
 
-    virtual llvm::Value* codegen(CodeGen& gen);
+    static bool classof(const ExprAST* e) { return e->getKind() == StringLit; }
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
 /// BoolLitExprAST - Expression class for boolean literals (true and false)
 class BoolLitExprAST : public ExprAST {
     bool val;
 public:
-    BoolLitExprAST(bool Val) : val(Val) {}
+    BoolLitExprAST(bool Val) : ExprAST{BoolLit}, val(Val) {}
+    bool getValue() const { return val; }
 
-    virtual llvm::Value* codegen(CodeGen& gen);
+    static bool classof(const ExprAST* e) { return e->getKind() == BoolLit; }
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
-    std::string name;
+    llvm::StringRef name; ///< View into the script
 public:
-    VariableExprAST(const std::string &Name) : name(Name) {}
+    VariableExprAST(llvm::StringRef Name) : ExprAST{Variable}, name(Name) {}
 
-    virtual llvm::Value* codegen(CodeGen& gen);
+    static bool classof(const ExprAST* e) { return e->getKind() == Variable; }
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
 /// UnaryExprAST - Expression class for a void value
 class VoidExprAST : public ExprAST {
 public:
-    VoidExprAST() {}
+    VoidExprAST() : ExprAST{Void} {}
 
-    virtual llvm::Value* codegen(CodeGen& gen);
+    static bool classof(const ExprAST* e) { return e->getKind() == Void; }
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
 /// UnaryExprAST - Expression class for a unary operator.
@@ -85,10 +175,13 @@ class UnaryExprAST : public ExprAST {
     ExprAST *rhs;
 public:
     UnaryExprAST(char Op, ExprAST *RHS)
-    : op(Op), rhs(RHS) {}
+    : ExprAST{Unary}, op(Op), rhs(RHS) {}
 
-    virtual llvm::Value* codegen(CodeGen& gen);
+    static bool classof(const ExprAST* e) { return e->getKind() == Unary; }
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -97,33 +190,42 @@ class BinaryExprAST : public ExprAST {
     ExprAST *lhs, *rhs;
 public:
     BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
-      : op(Op), lhs(LHS), rhs(RHS) {}
+      : ExprAST{Binary}, op(Op), lhs(LHS), rhs(RHS) {}
 
-    virtual llvm::Value* codegen(CodeGen& gen);
+    static bool classof(const ExprAST* e) { return e->getKind() == Binary; }
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
-/// SequenceExprAST - Expression class for an operator that computes both and returns the rhs
-class SequenceExprAST : public ExprAST {
-    ExprAST *lhs, *rhs;
+/// BlockExprAST - Expression class for a list of expressions, evaluated in order. Returns the last one.
+class BlockExprAST : public ExprAST {
+    llvm::MutableArrayRef<ExprAST*> exprs; ///< Stored in the arena, never empty
 public:
-    SequenceExprAST(ExprAST *LHS, ExprAST *RHS)
-      : lhs(LHS), rhs(RHS) {}
+    BlockExprAST(llvm::MutableArrayRef<ExprAST*> Exprs)
+      : ExprAST{Block}, exprs(Exprs) {}
 
-    virtual llvm::Value* codegen(CodeGen& gen);
+    static bool classof(const ExprAST* e) { return e->getKind() == Block; }
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
-    std::string callee;
-    std::vector<ExprAST*> args;
+    llvm::StringRef callee; ///< View into the script
+    llvm::MutableArrayRef<ExprAST*> args; ///< Stored in the arena
 public:
-    CallExprAST(const std::string &Callee, std::vector<ExprAST*> &Args)
-      : callee(Callee), args(Args) {}
+    CallExprAST(llvm::StringRef Callee, llvm::MutableArrayRef<ExprAST*> Args)
+      : ExprAST{Call}, callee(Callee), args(Args) {}
 
-    virtual llvm::Value* codegen(CodeGen& gen);
+    static bool classof(const ExprAST* e) { return e->getKind() == Call; }
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
 /// IfExprAST - Expression class for if/then/else.
@@ -131,27 +233,107 @@ class IfExprAST : public ExprAST {
   ExprAST *condAST, *thenAST, *elseAST;
 public:
   IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
-    : condAST(Cond), thenAST(Then), elseAST(Else) {}
+    : ExprAST{If}, condAST(Cond), thenAST(Then), elseAST(Else) {}
 
-  virtual llvm::Value* codegen(CodeGen& gen);
+  static bool classof(const ExprAST* e) { return e->getKind() == If; }
   friend class CodeGen;
+  friend class ASTSimplifier;
+  friend class TypeChecker;
+  friend class FlatAST;
+};
+
+/// WhileExprAST - Expression class for while loops, evaluates to void.
+class WhileExprAST : public ExprAST {
+    ExprAST *condAST, *bodyAST;
+public:
+    WhileExprAST(ExprAST *Cond, ExprAST *Body)
+      : ExprAST{While}, condAST(Cond), bodyAST(Body) {}
+
+    static bool classof(const ExprAST* e) { return e->getKind() == While; }
+    friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
+};
+
+/// ForExprAST - Expression class for counted loops, where the int variable goes from start to end-1.
+/// Evaluates to void.
+class ForExprAST : public ExprAST {
+    llvm::StringRef varName; ///< View into the script, only visible in the body
+    ExprAST *startAST, *endAST, *bodyAST;
+public:
+    ForExprAST(llvm::StringRef VarName, ExprAST *Start, ExprAST *End, ExprAST *Body)
+      : ExprAST{For}, varName(VarName), startAST(Start), endAST(End), bodyAST(Body) {}
+
+    static bool classof(const ExprAST* e) { return e->getKind() == For; }
+    friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
+};
+
+/// VarExprAST - Expression class for declaring a local variable, like "var a = 1". Evaluates to void.
+class VarExprAST : public ExprAST {
+    llvm::StringRef name; ///< View into the script, visible until the end of the enclosing block
+    ExprAST *initAST; ///< Gives the variable its type
+public:
+    VarExprAST(llvm::StringRef Name, ExprAST *Init)
+      : ExprAST{Var}, name(Name), initAST(Init) {}
+
+    static bool classof(const ExprAST* e) { return e->getKind() == Var; }
+    friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
+};
+
+/// AssignExprAST - Expression class for assigning a local variable, like "a = a + 1". Evaluates to void.
+class AssignExprAST : public ExprAST {
+    llvm::StringRef name; ///< View into the script
+    ExprAST *valueAST;
+public:
+    AssignExprAST(llvm::StringRef Name, ExprAST *Value)
+      : ExprAST{Assign}, name(Name), valueAST(Value) {}
+
+    static bool classof(const ExprAST* e) { return e->getKind() == Assign; }
+    friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
+};
+
+/// CastExprAST - Implicit conversion to the node's type, inserted by the TypeChecker.
+class CastExprAST : public ExprAST {
+    ExprAST *operand;
+public:
+    CastExprAST(ExprAST *Operand)
+      : ExprAST{Cast}, operand(Operand) {}
+
+    static bool classof(const ExprAST* e) { return e->getKind() == Cast; }
+    friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
+    friend class FlatAST;
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
-/// of arguments the function takes).
+/// of arguments the function takes). Names are views into the script,
+/// and the argument arrays are stored in the arena.
 class PrototypeAST {
     llvm::Type* retType;
-    std::string name;
-    std::vector<llvm::Type*> argTypes;
-    std::vector<std::string> argNames;
+    llvm::StringRef name;
+    llvm::ArrayRef<llvm::Type*> argTypes;
+    llvm::ArrayRef<llvm::StringRef> argNames;
 public:
-    PrototypeAST(llvm::Type* RetType, const std::string &Name,
-                 const std::vector<llvm::Type*>& ArgTypes,
-                 const std::vector<std::string> &ArgNames)
+    PrototypeAST(llvm::Type* RetType, llvm::StringRef Name,
+                 llvm::ArrayRef<llvm::Type*> ArgTypes,
+                 llvm::ArrayRef<llvm::StringRef> ArgNames)
       : retType{RetType}, name{Name}, argTypes{ArgTypes}, argNames{ArgNames} {}
 
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
 };
 
 /// FunctionAST - This class represents a function definition itself.
@@ -163,13 +345,15 @@ public:
       : proto(Proto), body(Body) {}
 
     friend class CodeGen;
+    friend class ASTSimplifier;
+    friend class TypeChecker;
 };
 
 /// Creates AST nodes from a tokenizer
 class ASTParser
 {
 public:
-    ASTParser(Tokenizer& Tokenizer);
+    ASTParser(Tokenizer& Tokenizer, llvm::LLVMContext& Context);
 
     ExprAST* parseIntLitExpr();
     ExprAST* parseFloatLitExpr();
@@ -182,19 +366,34 @@ public:
     ExprAST* parseExpression();
     ExprAST* parseBinOpRHS(int exprPrec, ExprAST *lhs);
     ExprAST* parseIfExpr();
+    ExprAST* parseWhileExpr();
+    ExprAST* parseForExpr();
+    ExprAST* parseVarExpr();
     ExprAST* parseBlock();
     PrototypeAST* parsePrototype();
     FunctionAST* parseDefinition();
     PrototypeAST* parseExtern();
     FunctionAST* parseTopLevelExpr();
 
+    /// Frees every AST node parsed so far in one shot. Previously returned ASTs become invalid.
+    void releaseAST();
+    ASTArena& getArena(); ///< Passes that create new nodes allocate them here
+    uint64_t getNodeCount() const; ///< Expression nodes parsed so far, including released ones
+
 private:
+    /// Allocates an expression node in the arena, tagged with the current line
+    template <class T, class... Args>
+    T* create(Args&&... args);
+
     ExprAST *error(const char *str);
     PrototypeAST *errorP(const char *str);
     FunctionAST *errorF(const char *str);
 
 private:
     Tokenizer& tokenizer;
+    llvm::LLVMContext& context; ///< Of the types in the AST
+    ASTArena arena;
+    uint64_t nodeCount;
 };
 
 #endif // EXPRAST_H
@@ -0,0 +1,175 @@
+#include "flatast.h"
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/Support/ErrorHandling.h>
+
+using namespace llvm;
+
+static FlatAST::TypeTag getTypeTag(Type* type)
+{
+    if (type->isDoubleTy())
+        return FlatAST::FloatType;
+    if (type->isIntegerTy(64))
+        return FlatAST::IntType;
+    if (type->isIntegerTy(1))
+        return FlatAST::BoolType;
+    if (type->isPointerTy())
+        return FlatAST::StringType;
+    return FlatAST::VoidType;
+}
+
+FlatAST::FlatAST()
+{
+    clear();
+}
+
+void FlatAST::clear()
+{
+    kinds.clear();
+    types.clear();
+    lines.clear();
+    payloads.clear();
+    operandEnds.assign(1, 0);
+    operands.clear();
+    ints.clear();
+    floats.clear();
+    chars.clear();
+    stringEnds.clear();
+    stringIds.clear();
+}
+
+uint32_t FlatAST::addString(StringRef str)
+{
+    auto id = stringIds.insert(std::make_pair(str, (uint32_t)stringEnds.size()));
+    if (id.second)
+    {
+        chars.insert(chars.end(), str.begin(), str.end());
+        stringEnds.push_back(chars.size());
+    }
+    return id.first->second;
+}
+
+StringRef FlatAST::getString(Node n) const
+{
+    uint32_t id = payloads[n];
+    uint32_t begin = id ? stringEnds[id-1] : 0;
+    return StringRef(chars.data() + begin, stringEnds[id] - begin);
+}
+
+FlatAST::Node FlatAST::emit(ExprAST* ast)
+{
+    // The operands are emitted first, their indices only go in the operand pool once they're all done
+    SmallVector<Node, 4> ops;
+    uint32_t payload = 0;
+    switch (ast->getKind())
+    {
+        case ExprAST::IntLit:
+            payload = ints.size();
+            ints.push_back(static_cast<IntLitExprAST*>(ast)->val);
+            break;
+        case ExprAST::FloatLit:
+            payload = floats.size();
+            floats.push_back(static_cast<FloatLitExprAST*>(ast)->val);
+            break;
+        case ExprAST::StringLit:
+            payload = addString(static_cast<StringLitExprAST*>(ast)->str);
+            break;
+        case ExprAST::BoolLit:
+            payload = static_cast<BoolLitExprAST*>(ast)->val;
+            break;
+        case ExprAST::Variable:
+            payload = addString(static_cast<VariableExprAST*>(ast)->name);
+            break;
+        case ExprAST::Void:
+            break;
+        case ExprAST::Unary:
+        {
+            UnaryExprAST* unary = static_cast<UnaryExprAST*>(ast);
+            payload = (unsigned char)unary->op;
+            ops.push_back(emit(unary->rhs));
+            break;
+        }
+        case ExprAST::Binary:
+        {
+            BinaryExprAST* binary = static_cast<BinaryExprAST*>(ast);
+            payload = (unsigned char)binary->op;
+            ops.push_back(emit(binary->lhs));
+            ops.push_back(emit(binary->rhs));
+            break;
+        }
+        case ExprAST::Block:
+            for (ExprAST* expr : static_cast<BlockExprAST*>(ast)->exprs)
+                ops.push_back(emit(expr));
+            break;
+        case ExprAST::Call:
+        {
+            CallExprAST* call = static_cast<CallExprAST*>(ast);
+            payload = addString(call->callee);
+            for (ExprAST* arg : call->args)
+                ops.push_back(emit(arg));
+            break;
+        }
+        case ExprAST::If:
+        {
+            IfExprAST* ifAST = static_cast<IfExprAST*>(ast);
+            ops.push_back(emit(ifAST->condAST));
+            ops.push_back(emit(ifAST->thenAST));
+            ops.push_back(emit(ifAST->elseAST));
+            break;
+        }
+        case ExprAST::While:
+        {
+            WhileExprAST* whileAST = static_cast<WhileExprAST*>(ast);
+            ops.push_back(emit(whileAST->condAST));
+            ops.push_back(emit(whileAST->bodyAST));
+            break;
+        }
+        case ExprAST::For:
+        {
+            ForExprAST* forAST = static_cast<ForExprAST*>(ast);
+            payload = addString(forAST->varName);
+            ops.push_back(emit(forAST->startAST));
+            ops.push_back(emit(forAST->endAST));
+            ops.push_back(emit(forAST->bodyAST));
+            break;
+        }
+        case ExprAST::Var:
+        {
+            VarExprAST* var = static_cast<VarExprAST*>(ast);
+            payload = addString(var->name);
+            ops.push_back(emit(var->initAST));
+            break;
+        }
+        case ExprAST::Assign:
+        {
+            AssignExprAST* assign = static_cast<AssignExprAST*>(ast);
+            payload = addString(assign->name);
+            ops.push_back(emit(assign->valueAST));
+            break;
+        }
+        case ExprAST::Cast:
+            ops.push_back(emit(static_cast<CastExprAST*>(ast)->operand));
+            break;
+    }
+
+    kinds.push_back(ast->getKind());
+    types.push_back(getTypeTag(ast->getType()));
+    lines.push_back(ast->getLine());
+    payloads.push_back(payload);
+    operands.insert(operands.end(), ops.begin(), ops.end());
+    operandEnds.push_back(operands.size());
+    return kinds.size() - 1;
+}
+
+Type* FlatAST::getLLVMType(TypeTag type, LLVMContext& context)
+{
+    switch (type)
+    {
+        case VoidType:   return Type::getVoidTy(context);
+        case IntType:    return Type::getInt64Ty(context);
+        case FloatType:  return Type::getDoubleTy(context);
+        case BoolType:   return Type::getInt1Ty(context);
+        case StringType: return Type::getInt8PtrTy(context);
+    }
+    llvm_unreachable("Unknown FlatAST type");
+}
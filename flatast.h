@@ -0,0 +1,82 @@
+#ifndef FLATAST_H
+#define FLATAST_H
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <cstdint>
+#include <vector>
+#include "exprast.h"
+
+namespace llvm {
+class LLVMContext;
+class Type;
+}
+
+/// FlatAST - A checked function body stored as a structure of arrays.
+/// The parser still builds the pointer tree, CodeGen flattens each body once checked and simplified.
+/// Nodes are indices into parallel arrays of kinds, types, source lines and payloads, emitted in post-order
+/// so the operands of a node are always earlier nodes and the root is the last one.
+/// Literals and names live in pools, and nothing points into the script or an LLVMContext.
+/// Emitting reuses the arrays' memory, so flattening each definition doesn't allocate once warm.
+class FlatAST
+{
+public:
+    typedef uint32_t Node;
+    /// The script types, CodeGen maps them back to the LLVM types of its context
+    enum TypeTag : unsigned char
+    {
+        VoidType,
+        IntType,
+        FloatType,
+        BoolType,
+        StringType,
+    };
+
+    FlatAST();
+
+    void clear(); ///< Keeps the capacity of the arrays
+    /// Appends the tree of a node checked by the TypeChecker, operands first. Returns the node of ast.
+    Node emit(ExprAST* ast);
+
+    Node getRoot() const { return kinds.size() - 1; }
+    size_t size() const { return kinds.size(); }
+    ExprAST::Kind getKind(Node n) const { return kinds[n]; }
+    TypeTag getType(Node n) const { return types[n]; }
+    unsigned getLine(Node n) const { return lines[n]; }
+    /// Operands in the order of the tree's fields, like lhs then rhs, or cond, then, else
+    llvm::ArrayRef<Node> getOperands(Node n) const
+    {
+        return llvm::makeArrayRef(operands.data() + operandEnds[n], operandEnds[n+1] - operandEnds[n]);
+    }
+    char getOp(Node n) const { return (char)payloads[n]; } ///< Of Unary and Binary nodes
+    int64_t getInt(Node n) const { return ints[payloads[n]]; }
+    double getFloat(Node n) const { return floats[payloads[n]]; }
+    bool getBool(Node n) const { return payloads[n]; }
+    /// The value of a StringLit, or the name of a Variable, of a Call's callee, of a For's variable,
+    /// or of the variable of a Var or Assign
+    llvm::StringRef getString(Node n) const;
+
+    static llvm::Type* getLLVMType(TypeTag type, llvm::LLVMContext& context);
+
+private:
+    uint32_t addString(llvm::StringRef str);
+
+private:
+    std::vector<ExprAST::Kind> kinds;
+    std::vector<TypeTag> types;
+    std::vector<uint32_t> lines;
+    /// Index in the int, float or string pool, operator char or bool value, depending on the kind
+    std::vector<uint32_t> payloads;
+    /// Operands of node n are operands[operandEnds[n], operandEnds[n+1]), there's a leading 0
+    std::vector<uint32_t> operandEnds;
+    std::vector<Node> operands;
+    std::vector<int64_t> ints;
+    std::vector<double> floats;
+    /// String i is chars[stringEnds[i-1], stringEnds[i]), they're not null terminated
+    std::vector<char> chars;
+    std::vector<uint32_t> stringEnds;
+    llvm::StringMap<uint32_t> stringIds; ///< Interns names while emitting
+};
+
+#endif // FLATAST_H
@@ -8,20 +8,92 @@
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FormattedStream.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/ADT/SmallString.h>
+#include <mutex>
 
 using namespace llvm;
 using namespace llvm::legacy;
 
-Lightscript::Lightscript(const std::vector<char> &Script)
-    : script{Script},
-      module{new Module{"LightScript JIT", getGlobalContext()}},
-      FPM{new FunctionPassManager{module}}, tokenizer{script},
-      parser{tokenizer}, jit{new MCJITHelper(getGlobalContext())},
-      codegen{jit}, optimize{false}
+/// A letter for each script type, like "b(if)" for bool(int, float)
+static char encodeType(Type* type)
 {
-    InitializeNativeTarget();
-    InitializeNativeTargetAsmPrinter();
-    InitializeNativeTargetAsmParser();
+    if (type->isVoidTy())
+        return 'v';
+    if (type->isIntegerTy(64))
+        return 'i';
+    if (type->isDoubleTy())
+        return 'f';
+    if (type->isIntegerTy(1))
+        return 'b';
+    return 's';
+}
+
+static std::string encodeSignature(FunctionType* type)
+{
+    std::string sig{encodeType(type->getReturnType())};
+    sig += '(';
+    for (Type* param : type->params())
+        sig += encodeType(param);
+    return sig + ')';
+}
+
+static Type* decodeType(char code, LLVMContext& context)
+{
+    switch (code)
+    {
+        case 'v': return Type::getVoidTy(context);
+        case 'i': return Type::getInt64Ty(context);
+        case 'f': return Type::getDoubleTy(context);
+        case 'b': return Type::getInt1Ty(context);
+        case 's': return Type::getInt8PtrTy(context);
+        default:  return 0;
+    }
+}
+
+/// Returns null if sig wasn't made by encodeSignature
+static FunctionType* decodeSignature(StringRef sig, LLVMContext& context)
+{
+    if (sig.size() < 3 || sig[1] != '(' || sig.back() != ')')
+        return 0;
+    Type* retType = decodeType(sig[0], context);
+    SmallVector<Type*, 8> argTypes;
+    for (char code : sig.slice(2, sig.size() - 1))
+    {
+        Type* argType = decodeType(code, context);
+        if (!argType || argType->isVoidTy())
+            return 0;
+        argTypes.push_back(argType);
+    }
+    return retType ? FunctionType::get(retType, argTypes, false) : 0;
+}
+
+Lightscript::Lightscript(StringRef Script)
+    : script{Script}, tokenizer{script},
+      parser{tokenizer, context}, typeChecker{parser.getArena(), context},
+      simplifier{parser.getArena()}, jit{new MCJITHelper(context)},
+      codegen{jit.get(), context}, exports{"init", "exit"}, wholeScript{false}
+{
+    // The target registry is global, only fill it once
+    static std::once_flag targetInitialized;
+    std::call_once(targetInitialized, []
+    {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+    });
+}
+
+Lightscript::Lightscript(std::unique_ptr<MemoryBuffer> Script)
+    : Lightscript{Script->getBuffer()}
+{
+    buffer = std::move(Script);
 }
 
 Lightscript::~Lightscript()
@@ -29,14 +101,150 @@ Lightscript::~Lightscript()
 
 }
 
+void Lightscript::setLazyCompilation(bool enable)
+{
+    jit->setLazyCompilation(enable);
+}
+
+void Lightscript::setTieredCompilation(bool enable, unsigned hotThreshold)
+{
+    jit->setTieredCompilation(enable, hotThreshold);
+}
+
+void Lightscript::setParallelCompilation(unsigned threads, unsigned functionsPerUnit)
+{
+    jit->setParallelCompilation(threads, functionsPerUnit);
+}
+
+void Lightscript::setOptimizationLevel(unsigned level)
+{
+    jit->setOptLevel(level > 3 ? 3 : level);
+}
+
+void Lightscript::setWholeScriptLinking(bool enable)
+{
+    wholeScript = enable;
+}
+
+void Lightscript::exportFunction(const std::string& name)
+{
+    exports.push_back(name);
+}
+
+void Lightscript::registerNative(const std::string& name, void* address, FunctionType* type)
+{
+    nativeSignatures += name + encodeSignature(type) + ",";
+    typeChecker.declareNative(name, type);
+    jit->addNativeFunction(name, address);
+}
+
+void Lightscript::setProfiling(bool enable)
+{
+    profiler.reset(enable ? new Profiler : 0);
+    jit->setProfiler(profiler.get());
+}
+
+std::vector<FunctionProfile> Lightscript::getProfile() const
+{
+    return profiler ? profiler->read() : std::vector<FunctionProfile>{};
+}
+
+void Lightscript::resetProfile()
+{
+    if (profiler)
+        profiler->reset();
+}
+
+CompileStats Lightscript::getCompileStats() const
+{
+    CompileStats total;
+    total.frontend = stats;
+    total.frontend.lexTime = tokenizer.getLexTime();
+    total.frontend.tokens = tokenizer.getTokens().size() - 1; // Without the placeholder
+    total.frontend.astNodes = parser.getNodeCount();
+    total.backend = jit->getStats();
+    return total;
+}
+
+void Lightscript::setObjectCacheDir(const std::string& dir)
+{
+    cacheDir = dir;
+}
+
+bool Lightscript::loadCachedScript()
+{
+    // Anything that changes the generated code must be part of the key
+    std::string settings = "lazy=" + std::to_string(jit->isLazyCompilation())
+                         + " tiered=" + std::to_string(jit->getTierThreshold())
+                         + " units=" + std::to_string(jit->getUnitSize())
+                         + " O" + std::to_string(jit->getOptLevel())
+                         + " whole=" + std::to_string(wholeScript) + " exports=";
+    for (const std::string& name : exports)
+        settings += name + ",";
+    // Calls to natives are compiled for their signature
+    settings += " natives=" + nativeSignatures;
+    cache.reset(new ObjectFileCache{cacheDir, ObjectFileCache::makeKey(script, settings)});
+    jit->setObjectCache(cache.get());
+
+    // Lazy scripts are split in modules that are only known after parsing,
+    // but otherwise the whole script is the first module JITed
+    if (jit->isLazyCompilation())
+        return false;
+
+    // get() checks the cached functions against the signatures saved with them
+    std::unique_ptr<MemoryBuffer> signatures = cache->getFile("signatures");
+    if (!signatures)
+        return false;
+    std::vector<std::pair<StringRef, FunctionType*>> definitions;
+    SmallVector<StringRef, 64> lines;
+    signatures->getBuffer().split(lines, "\n", -1, false);
+    for (StringRef line : lines)
+    {
+        std::pair<StringRef, StringRef> fields = line.split(' ');
+        FunctionType* type = decodeSignature(fields.second, context);
+        if (fields.first.empty() || !type)
+            return false;
+        definitions.push_back(std::make_pair(fields.first, type));
+    }
+
+    std::unique_ptr<MemoryBuffer> object = cache->getObject(MCJITHelper::getModuleName(0));
+    if (!object || !jit->loadObject(std::move(object)) || !jit->getSymbolAddress("init"))
+        return false;
+    for (auto& definition : definitions)
+        typeChecker.declareDefinition(definition.first, definition.second);
+    return true;
+}
+
+void Lightscript::saveSignatures()
+{
+    std::string signatures;
+    for (auto& definition : typeChecker.getDefinitions())
+        signatures += definition.first.str() + " " + encodeSignature(definition.second) + "\n";
+    cache->saveFile("signatures", signatures);
+}
+
 void Lightscript::handleDefinition()
 {
-    if (FunctionAST *f = parser.parseDefinition())
+    FunctionAST *f;
     {
-        if (Function *lf = codegen.codegen(f))
+        PhaseTimer timer{stats.parseTime};
+        f = parser.parseDefinition();
+    }
+
+    if (f)
+    {
+        bool valid;
+        {
+            PhaseTimer timer{stats.checkTime};
+            valid = typeChecker.check(f);
+            if (valid)
+                simplifier.simplify(f);
+        }
+        if (valid)
         {
-            fprintf(stderr, "Read function definition:");
-            lf->dump();
+            PhaseTimer timer{stats.irgenTime};
+            codegen.codegen(f);
+            ++stats.functions;
         }
     }
     else
@@ -44,16 +252,25 @@ void Lightscript::handleDefinition()
         // Skip token for error recovery.
         tokenizer.getNextToken();
     }
+
+    // The AST isn't needed after codegen, release it in one go
+    parser.releaseAST();
 }
 
 void Lightscript::handleExtern()
 {
-    if (PrototypeAST *p = parser.parseExtern())
+    PrototypeAST *p;
     {
-        if (Function *f = codegen.codegen(p))
+        PhaseTimer timer{stats.parseTime};
+        p = parser.parseExtern();
+    }
+
+    if (p)
+    {
+        if (typeChecker.check(p))
         {
-            fprintf(stderr, "Read extern: ");
-            f->dump();
+            PhaseTimer timer{stats.irgenTime};
+            codegen.codegen(p);
         }
     }
     else
@@ -61,6 +278,8 @@ void Lightscript::handleExtern()
         // Skip token for error recovery.
         tokenizer.getNextToken();
     }
+
+    parser.releaseAST();
 }
 
 void Lightscript::handleTopLevelExpression()
@@ -68,18 +287,19 @@ void Lightscript::handleTopLevelExpression()
     // Evaluate a top-level expression into an anonymous function.
     if (FunctionAST *f = parser.parseTopLevelExpr())
     {
-        if (Function *lf = codegen.codegen(f))
+        if (typeChecker.check(f))
         {
-            fprintf(stderr, "Read top-level expression:");
-            lf->dump();
+            simplifier.simplify(f);
+            if (Function *lf = codegen.codegen(f))
+            {
+                // JIT the function, returning a function pointer.
+                void *FPtr = jit->getPointerToFunction(lf);
 
-            // JIT the function, returning a function pointer.
-            void *FPtr = jit->getPointerToFunction(lf);
-
-            // Cast it to the right type (takes no arguments, returns a double) so we
-            // can call it as a native function.
-            double (*fp)() = (double (*)())(intptr_t)FPtr;
-            fprintf(stderr, "Evaluated to %f\n", fp());
+                // Cast it to the right type (takes no arguments, returns a double) so we
+                // can call it as a native function.
+                double (*fp)() = (double (*)())(intptr_t)FPtr;
+                fprintf(stderr, "Evaluated to %f\n", fp());
+            }
         }
     }
     else
@@ -87,9 +307,11 @@ void Lightscript::handleTopLevelExpression()
         // Skip token for error recovery.
         tokenizer.getNextToken();
     }
+
+    parser.releaseAST();
 }
 
-bool Lightscript::compile()
+bool Lightscript::parse()
 {
     char curTok = (char)tokenizer.getNextToken();
     while (curTok != tok_eof)
@@ -110,25 +332,183 @@ bool Lightscript::compile()
         }
     }
 
-    Type* voidTy = Type::getVoidTy(getGlobalContext());
-    Type* boolTy = Type::getInt1Ty(getGlobalContext());
-    Function* init = jit->getFunction("init");
-    if (!init || init->getReturnType() != boolTy
-            || init->getArgumentList().size())
+    // Checked against the TypeChecker, the IR of parallel units lives in other contexts
+    if (typeChecker.getDefinition("init") != FunctionType::get(Type::getInt1Ty(context), false))
     {
         fprintf(stderr, "Script must have an init function of the form 'bool init()'\n");
         return false;
     }
-    Function* exit = jit->getFunction("exit");
-    if (!exit || exit->getReturnType() != voidTy
-            || exit->getArgumentList().size())
+    if (typeChecker.getDefinition("exit") != FunctionType::get(Type::getVoidTy(context), false))
     {
         fprintf(stderr, "Script must have an exit function of the form 'void exit()'\n");
         return false;
     }
+    return true;
+}
+
+bool Lightscript::compile()
+{
+    // Splitting the script in lazy modules would hide calls from the optimizer
+    if (wholeScript)
+    {
+        if (jit->isLazyCompilation())
+        {
+            fprintf(stderr, "Whole script linking can't be combined with lazy, tiered or parallel compilation\n");
+            return false;
+        }
+        jit->setExportedFunctions(exports);
+    }
+
+    // The script was checked before its object was cached, skip the frontend entirely
+    if (!cacheDir.empty() && !profiler)
+        if (loadCachedScript())
+            return runInit(get<bool()>("init"));
+
+    if (!parse())
+        return false;
+    if (cache)
+        saveSignatures();
+    return runInit(get<bool()>("init"));
+}
+
+bool Lightscript::compileToObject(const std::string& path)
+{
+    // The probes call into the jit
+    if (profiler)
+    {
+        fprintf(stderr, "Profiled scripts can't be compiled ahead of time\n");
+        return false;
+    }
 
-    bool (*initPtr)() = (bool(*)())jit->getPointerToFunction(init);
-    if (initPtr())
+    // The whole script must end up in a single module
+    if (jit->isLazyCompilation())
+    {
+        fprintf(stderr, "Scripts compiled ahead of time can't use lazy, tiered or parallel compilation\n");
+        return false;
+    }
+    if (wholeScript)
+        jit->setExportedFunctions(exports);
+    if (!parse())
+        return false;
+    std::unique_ptr<Module> m = jit->takeOpenModule();
+
+    // Production hosts may not have our CPU, only target the generic one
+    std::string triple = sys::getProcessTriple();
+    std::string err;
+    const Target* target = TargetRegistry::lookupTarget(triple, err);
+    if (!target)
+    {
+        fprintf(stderr, "Can't compile for %s: %s\n", triple.c_str(), err.c_str());
+        return false;
+    }
+    std::unique_ptr<TargetMachine> tm{target->createTargetMachine(triple, "", "", TargetOptions{},
+                                                                  Reloc::PIC_, CodeModel::Default,
+                                                                  jit->getCodeGenOptLevel())};
+    m->setTargetTriple(triple);
+    m->setDataLayout(tm->getDataLayout());
+    jit->optimizeModule(m.get());
+
+    // Script functions get a prefix, so they can't clash with the host's symbols (like exit)
+    for (Function& f : *m)
+        if (!f.isDeclaration())
+            f.setName(AOT_SYMBOL_PREFIX + f.getName());
+
+    std::error_code ec;
+    raw_fd_ostream out{path, ec, sys::fs::F_None};
+    if (ec)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", path.c_str(), ec.message().c_str());
+        return false;
+    }
+    formatted_raw_ostream fout{out};
+    legacy::PassManager pm;
+    pm.add(new DataLayoutPass());
+    if (tm->addPassesToEmitFile(pm, fout, TargetMachine::CGFT_ObjectFile))
+    {
+        fprintf(stderr, "Can't emit object files for %s\n", triple.c_str());
+        return false;
+    }
+    pm.run(*m);
+    return true;
+}
+
+bool Lightscript::compileToSharedLibrary(const std::string& path)
+{
+    SmallString<128> objPath;
+    if (sys::fs::createTemporaryFile("lightscript", "o", objPath))
+    {
+        fprintf(stderr, "Could not create a temporary object file\n");
+        return false;
+    }
+    bool ok = compileToObject(objPath.str().str());
+
+    // Leave the linking to the system's compiler driver
+    ErrorOr<std::string> cc = sys::findProgramByName("cc");
+    if (ok && !cc)
+    {
+        fprintf(stderr, "Could not find a linker (cc) to build %s\n", path.c_str());
+        ok = false;
+    }
+    if (ok)
+    {
+        std::string obj = objPath.str().str();
+        const char* args[] = {cc->c_str(), "-shared", "-o", path.c_str(), obj.c_str(), nullptr};
+        std::string errMsg;
+        if (sys::ExecuteAndWait(*cc, args, nullptr, nullptr, 0, 0, &errMsg))
+        {
+            fprintf(stderr, "Linking %s failed: %s\n", path.c_str(), errMsg.c_str());
+            ok = false;
+        }
+    }
+
+    sys::fs::remove(objPath.str());
+    return ok;
+}
+
+void* Lightscript::getFunctionAddress(const std::string& name, FunctionType* type)
+{
+    auto it = functions.find(name);
+    if (it == functions.end())
+    {
+        // The IR of parallel units moves to their own contexts, but the TypeChecker's types stay in ours
+        FunctionType* defined = typeChecker.getDefinition(name);
+        if (!defined)
+        {
+            fprintf(stderr, "Error: The script doesn't define a function '%s'\n", name.c_str());
+            return 0;
+        }
+
+        // In lazy mode, this compiles the function's module
+        void* address;
+        if (Function* f = jit->getFunction(name))
+            address = jit->getPointerToFunction(f);
+        else
+            address = jit->getSymbolAddress(name);
+        if (!address)
+            return 0;
+        it = functions.insert(std::make_pair(name, std::make_pair(address, defined))).first;
+    }
+
+    if (it->second.second != type)
+    {
+        fprintf(stderr, "Error: '%s' is called with the wrong signature\n", name.c_str());
+        return 0;
+    }
+    return it->second.first;
+}
+
+void* Lightscript::getBatchAddress(const std::string& name, FunctionType* type)
+{
+    if (!getFunctionAddress(name, type))
+        return 0;
+    return jit->getBatchFunction(name);
+}
+
+bool Lightscript::runInit(ScriptFunction<bool()> init)
+{
+    if (!init)
+        return false;
+    if (init())
         fprintf(stderr, "Init successful\n");
     else
         fprintf(stderr, "Init failed\n");
@@ -2,40 +2,132 @@
 #define LIGHTSCRIPT_H
 
 #include <vector>
+#include <memory>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/LLVMContext.h>
 #include "tokenizer.h"
 #include "exprast.h"
 #include "codegen.h"
+#include "astsimplifier.h"
+#include "typechecker.h"
+#include "objectcache.h"
+#include "scriptlibrary.h"
+#include "compilestats.h"
+#include "profiler.h"
+#include "nativetype.h"
+#include "scriptfunction.h"
+#include "stringruntime.h"
 
 namespace llvm{
-class Module;
-class ExecutionEngine;
-namespace legacy{class FunctionPassManager;}
+class MemoryBuffer;
 }
 class MCJITHelper;
 
 /// Compiles, runs, and interracts with a single script.
+/// Each instance has its own LLVM context and JIT, so different scripts can be compiled on different threads.
 class Lightscript
 {
 public:
-    Lightscript(const std::vector<char>& script);
+    Lightscript(llvm::StringRef script); ///< The script is not copied and must outlive the Lightscript
+    Lightscript(std::unique_ptr<llvm::MemoryBuffer> script); ///< Takes ownership of a (usually mmap'ed) buffer
     ~Lightscript();
 
+    /// Only compile functions the first time they're called, must be set before compile()
+    void setLazyCompilation(bool enable);
+    /// Compiles functions lazily at -O0 first, and recompiles them at -O3 in the background
+    /// once they have been called hotThreshold times. Must be set before compile().
+    void setTieredCompilation(bool enable, unsigned hotThreshold = 10000);
+    /// From 0 (fastest compilation) to 3 (fastest code) like -O, must be set before compile().
+    /// -O2 and up inline script functions into their callers, the default is 1.
+    void setOptimizationLevel(unsigned level);
+    /// Splits the script in units of functionsPerUnit functions, each optimized and compiled
+    /// on its own thread. 0 threads compiles on the calling thread. Must be set before compile().
+    void setParallelCompilation(unsigned threads, unsigned functionsPerUnit = 256);
+    /// Compiles the script as a single module where only init, exit and the exported functions
+    /// are visible, so the optimizer can inline and remove the others. Must be set before compile().
+    /// The script is a single module, so compile() fails if lazy, tiered or parallel compilation is set.
+    void setWholeScriptLinking(bool enable);
+    void exportFunction(const std::string& name); ///< Keeps a handler callable in whole script mode
+    /// Counts the calls and cycles of every script function, only supported by the JIT.
+    /// Must be set before compile(), without it the functions don't have any probes.
+    /// Profiled scripts are never cached, they must register their functions with the profiler.
+    void setProfiling(bool enable);
+    std::vector<FunctionProfile> getProfile() const; ///< Empty unless profiling
+    void resetProfile();
+    /// Binds the script's extern declaration of name to fn, calls are linked straight to it instead
+    /// of a symbol of the process. The extern must have fn's signature, with int64_t, double,
+    /// const char* and bool for int, float, string and bool. Strings returned to the script must be
+    /// made by the StringRuntime, like the strings the host passes to script functions.
+    /// Must be called before compile(). No natives are registered by default, scripts get
+    /// the length of a string with 'extern int __ls_string_length(string s)'.
+    template <class R, class... Args>
+    void registerNative(const std::string& name, R (*fn)(Args...))
+    {
+        registerNative(name, (void*)fn, NativeFunctionType<R(Args...)>::get(context));
+    }
+    void registerNative(const std::string& name, void* address, llvm::FunctionType* type);
+    /// Looks up a compiled script function and checks it has the signature F, like bool(int64_t).
+    /// Keep the handle, calling it costs no more than calling a function pointer. Returns a null handle
+    /// if the script doesn't define such a function or its signature doesn't match, natives and
+    /// other symbols of the process are never returned. Scripts loaded from the object
+    /// cache are checked against the signatures saved with their objects.
+    template <class F>
+    ScriptFunction<F> get(const std::string& name)
+    {
+        return ScriptFunction<F>{getFunctionAddress(name, NativeFunctionType<F>::get(context))};
+    }
+    /// Compiles a loop that calls the script function name over n rows of arguments, each argument
+    /// in its own array. The function is inlined in the loop and optimized at -O3, so simple ones
+    /// get vectorized. Checks the signature like get(), and also returns a null handle for scripts
+    /// loaded from the object cache, since they have no IR to inline.
+    template <class F>
+    ScriptBatch<F> getBatch(const std::string& name)
+    {
+        return ScriptBatch<F>{getBatchAddress(name, NativeFunctionType<F>::get(context))};
+    }
+    /// Keeps the compiled script in dir across runs, must be set before compile()
+    void setObjectCacheDir(const std::string& dir);
     bool compile();
+    /// Time spent and code produced by each phase. Functions compiled lazily after compile()
+    /// keep adding to the backend's stats.
+    CompileStats getCompileStats() const;
+    /// Compiles the whole script ahead of time. Script functions are exported as AOT_SYMBOL_PREFIX
+    /// followed by their name, and are loaded back without LLVM by a ScriptLibrary.
+    /// Fails if lazy, tiered or parallel compilation is set, the object holds a single module.
+    bool compileToObject(const std::string& path);
+    bool compileToSharedLibrary(const std::string& path); ///< Links the object with the system's cc
 
 private:
+    bool parse(); ///< Generates the IR of the whole script and checks its entry points
+    bool loadCachedScript(); ///< Returns true if the whole script could be loaded from the cache
+    void saveSignatures(); ///< Of the script's definitions, next to its cached objects
+    bool runInit(ScriptFunction<bool()> init);
+    void* getFunctionAddress(const std::string& name, llvm::FunctionType* type);
+    void* getBatchAddress(const std::string& name, llvm::FunctionType* type);
     void handleExtern();
     void handleDefinition();
     void handleTopLevelExpression();
 
 private:
-    const std::vector<char> script;
-    llvm::Module *module;
-    llvm::legacy::FunctionPassManager* FPM;
+    std::unique_ptr<llvm::MemoryBuffer> buffer; ///< Only set when we own the script's memory
+    llvm::StringRef script;
+    llvm::LLVMContext context;
     Tokenizer tokenizer;
     ASTParser parser;
-    MCJITHelper* jit;
+    TypeChecker typeChecker;
+    ASTSimplifier simplifier;
+    std::string cacheDir;
+    std::unique_ptr<ObjectFileCache> cache; ///< Must outlive the jit
+    std::unique_ptr<Profiler> profiler; ///< Must outlive the jit
+    std::unique_ptr<MCJITHelper> jit;
     CodeGen codegen;
-    bool optimize;
+    std::vector<std::string> exports; ///< Functions visible in whole script mode, with init and exit
+    bool wholeScript;
+    /// Functions already looked up by get(), with their checked type
+    llvm::StringMap<std::pair<void*, llvm::FunctionType*>> functions;
+    std::string nativeSignatures; ///< Names and signatures of the natives, for the cache key
+    FrontendStats stats; ///< Lexing and node counts are taken from the tokenizer and parser
 };
 
 #endif // LIGHTSCRIPT_H
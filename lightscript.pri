@@ -0,0 +1,41 @@
+# The compiler and runtime, shared by the lightscript tool and the benchmark
+
+SOURCES += \
+    $$PWD/lightscript.cpp \
+    $$PWD/tokenizer.cpp \
+    $$PWD/exprast.cpp \
+    $$PWD/flatast.cpp \
+    $$PWD/codegen.cpp \
+    $$PWD/mcjithelper.cpp \
+    $$PWD/charscan.cpp \
+    $$PWD/astsimplifier.cpp \
+    $$PWD/typechecker.cpp \
+    $$PWD/objectcache.cpp \
+    $$PWD/scriptlibrary.cpp \
+    $$PWD/compilestats.cpp \
+    $$PWD/profiler.cpp \
+    $$PWD/stringruntime.cpp
+
+HEADERS += \
+    $$PWD/lightscript.h \
+    $$PWD/tokenizer.h \
+    $$PWD/exprast.h \
+    $$PWD/flatast.h \
+    $$PWD/codegen.h \
+    $$PWD/mcjithelper.h \
+    $$PWD/charscan.h \
+    $$PWD/astsimplifier.h \
+    $$PWD/typechecker.h \
+    $$PWD/objectcache.h \
+    $$PWD/scriptlibrary.h \
+    $$PWD/compilestats.h \
+    $$PWD/profiler.h \
+    $$PWD/nativetype.h \
+    $$PWD/scriptfunction.h \
+    $$PWD/stringruntime.h
+
+QMAKE_CXXFLAGS += $$system(llvm-config --cxxflags)
+LIBS += $$system(llvm-config --ldflags --system-libs --libs core mcjit native ipo bitreader bitwriter)
+LIBS += -ldl
+# Scripts compiled ahead of time link against the string runtime of the host
+QMAKE_LFLAGS += -rdynamic
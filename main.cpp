@@ -1,18 +1,77 @@
 #include <iostream>
-#include <fstream>
+#include <cstring>
+#include <llvm/Support/MemoryBuffer.h>
 #include "lightscript.h"
+#include "scriptlibrary.h"
 
 using namespace std;
+using namespace llvm;
 
-int main()
+static int usage()
 {
-    ifstream f("script.ls");
-    vector<char> data((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
-    if (f.is_open())
-        f.close();
+    cerr << "Usage: lightscript [-On] [-stats] [script.ls]       JIT and run a script (script.ls by default)\n"
+            "       lightscript [-On] -c out.o script.ls         Compile a script to an object file\n"
+            "       lightscript [-On] -shared out.so script.ls   Compile a script to a shared library\n"
+            "       lightscript -load script.so                  Run a compiled script, without the JIT\n"
+            "The optimization level n goes from 0 to 3, and defaults to 1\n"
+            "-stats prints the time spent in each compilation phase as JSON" << endl;
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    // A precompiled script never touches LLVM
+    if (argc == 3 && !strcmp(argv[1], "-load"))
+    {
+        ScriptLibrary lib;
+        if (!lib.load(argv[2]))
+            return 1;
+        fprintf(stderr, lib.init() ? "Init successful\n" : "Init failed\n");
+        return 0;
+    }
+
+    unsigned optLevel = 1;
+    if (argc > 1 && argv[1][0] == '-' && argv[1][1] == 'O' && argv[1][2] >= '0' && argv[1][2] <= '3' && !argv[1][3])
+    {
+        optLevel = argv[1][2] - '0';
+        --argc, ++argv;
+    }
+    bool printStats = false;
+    if (argc > 1 && !strcmp(argv[1], "-stats"))
+    {
+        printStats = true;
+        --argc, ++argv;
+    }
 
-    Lightscript script{data};
-    script.compile();
+    const char* path = "script.ls";
+    const char* output = 0;
+    bool shared = false;
+    if (argc == 4 && (!strcmp(argv[1], "-c") || !strcmp(argv[1], "-shared")))
+    {
+        shared = !strcmp(argv[1], "-shared");
+        output = argv[2];
+        path = argv[3];
+    }
+    else if (argc == 2 && argv[1][0] != '-')
+        path = argv[1];
+    else if (argc != 1)
+        return usage();
+
+    // Large scripts are mmap'ed instead of read, and the Lightscript never copies them
+    ErrorOr<unique_ptr<MemoryBuffer>> file = MemoryBuffer::getFile(path, -1, false);
+    if (!file)
+    {
+        cerr << "Could not open " << path << ": " << file.getError().message() << endl;
+        return 1;
+    }
+
+    Lightscript script{move(*file)};
+    script.setOptimizationLevel(optLevel);
+    if (!output)
+        script.compile();
+    else if (!(shared ? script.compileToSharedLibrary(output) : script.compileToObject(output)))
+        return 1;
+    if (printStats)
+        cout << script.getCompileStats().toJSON() << endl;
     return 0;
 }
-
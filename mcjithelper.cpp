@@ -1,5 +1,10 @@
 #include "mcjithelper.h"
-#include "llvm/Analysis/Passes.h"
+#include "objectcache.h"
+#include "profiler.h"
+#include "stringruntime.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/MCJIT.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
@@ -8,29 +13,28 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Object/ObjectFile.h"
 #include "llvm/Support/TargetSelect.h"
-#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <algorithm>
 
 using namespace llvm;
 using namespace llvm::legacy;
 
-static Function* errorF(const char *str) { fprintf(stderr, "Error: %s\n", str); return 0; }
-
-// FIXME: Obviously we can do better than this
-std::string GenerateUniqueName(const char *root) {
-  static int i = 0;
-  char s[16];
-  sprintf(s, "%s%d", root, i++);
-  std::string S = s;
-  return S;
+std::string MCJITHelper::generateUniqueName(const char *Root) {
+  return Root + std::to_string(NameCounter++);
 }
 
-std::string MakeLegalFunctionName(std::string Name) {
+std::string MCJITHelper::makeLegalFunctionName(std::string Name) {
   std::string NewName;
   if (!Name.length())
-    return GenerateUniqueName("anon_func_");
+    return generateUniqueName("anon_func_");
 
   // Start with what we have
   NewName = Name;
@@ -56,21 +60,50 @@ std::string MakeLegalFunctionName(std::string Name) {
 }
 
 uint64_t HelpingMemoryManager::getSymbolAddress(const std::string &Name) {
-  uint64_t FnAddr = SectionMemoryManager::getSymbolAddress(Name);
-  if (FnAddr)
-    return FnAddr;
+  if (void *Native = MasterHelper->getNativeFunction(Name))
+    return (uint64_t)Native;
+
+  // Script functions are a hash lookup, and shadow the process' symbols.
+  // Units compiled concurrently only call other units through their stubs.
+  uint64_t HelperFun =
+      Concurrent ? (uint64_t)MasterHelper->getRuntimeSymbolAddress(Name)
+                 : (uint64_t)MasterHelper->getSymbolAddress(Name);
+  if (HelperFun)
+    return HelperFun;
 
-  uint64_t HelperFun = (uint64_t)MasterHelper->getSymbolAddress(Name);
-  if (!HelperFun)
+  uint64_t FnAddr = SectionMemoryManager::getSymbolAddress(Name);
+  if (!FnAddr)
     report_fatal_error("Program used extern function '" + Name +
                        "' which could not be resolved!");
 
-  return HelperFun;
+  return FnAddr;
+}
+
+uint8_t *HelpingMemoryManager::allocateCodeSection(uintptr_t Size,
+                                                   unsigned Alignment,
+                                                   unsigned SectionID,
+                                                   StringRef SectionName) {
+  BackendStats S;
+  S.codeBytes = Size;
+  MasterHelper->addStats(S);
+  return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID,
+                                                   SectionName);
 }
 
 MCJITHelper::~MCJITHelper() {
+  if (Worker.joinable()) {
+    {
+      std::lock_guard<std::mutex> Lock(QueueLock);
+      Stopping = true;
+    }
+    QueueCV.notify_one();
+    Worker.join();
+  }
+
   if (OpenModule)
     delete OpenModule;
+  for (Module *M : PendingModules)
+    delete M;
   EngineVector::iterator begin = Engines.begin();
   EngineVector::iterator end = Engines.end();
   EngineVector::iterator it;
@@ -78,129 +111,771 @@ MCJITHelper::~MCJITHelper() {
     delete *it;
 }
 
-Function *MCJITHelper::getFunction(const std::string FnName) {
-  ModuleVector::iterator begin = Modules.begin();
-  ModuleVector::iterator end = Modules.end();
-  ModuleVector::iterator it;
-  for (it = begin; it != end; ++it) {
-    Function *F = (*it)->getFunction(FnName);
-    if (F) {
-      if (*it == OpenModule)
-        return F;
-
-      assert(OpenModule != NULL);
-
-      // This function is in a module that has already been JITed.
-      // We need to generate a new prototype for external linkage.
-      Function *PF = OpenModule->getFunction(FnName);
-      if (PF && !PF->empty()) {
-        errorF("redefinition of function across modules");
-        return 0;
-      }
+/// Script types are only void, ints, doubles and pointers to them, each
+/// context has its own instance of them.
+static Type *getTypeInContext(Type *T, LLVMContext &Context) {
+  if (&T->getContext() == &Context)
+    return T;
+  if (T->isVoidTy())
+    return Type::getVoidTy(Context);
+  if (T->isDoubleTy())
+    return Type::getDoubleTy(Context);
+  if (T->isIntegerTy())
+    return Type::getIntNTy(Context, T->getIntegerBitWidth());
+  assert(T->isPointerTy() && "Not a script type");
+  return PointerType::getUnqual(
+      getTypeInContext(T->getPointerElementType(), Context));
+}
 
-      // If we don't have a prototype yet, create one.
-      if (!PF)
-        PF = Function::Create(F->getFunctionType(), Function::ExternalLinkage,
-                              FnName, OpenModule);
-      return PF;
-    }
-  }
-  return NULL;
+static FunctionType *getTypeInContext(FunctionType *FT,
+                                      LLVMContext &Context) {
+  SmallVector<Type *, 8> Params;
+  for (Type *Param : FT->params())
+    Params.push_back(getTypeInContext(Param, Context));
+  return FunctionType::get(getTypeInContext(FT->getReturnType(), Context),
+                           Params, false);
+}
+
+Function *MCJITHelper::getFunction(StringRef FnName) {
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
+
+  // The open module has the most recent definitions and prototypes.
+  if (OpenModule)
+    if (Function *F = OpenModule->getFunction(FnName))
+      return F;
+
+  StringMap<FunctionEntry>::iterator It = FunctionIndex.find(FnName);
+  if (It == FunctionIndex.end())
+    return NULL;
+  Function *F = It->second.M->getFunction(FnName);
+  if (!OpenModule)
+    return F;
+
+  // This function is in a module that has already been JITed.
+  // We need to generate a new prototype for external linkage. Parallel units
+  // move to their own context, their types can't be used in ours.
+  return Function::Create(getTypeInContext(F->getFunctionType(), Context),
+                          Function::ExternalLinkage, FnName, OpenModule);
+}
+
+static unsigned countDefinitions(Module *M) {
+  unsigned Count = 0;
+  for (Module::iterator It = M->begin(), End = M->end(); It != End; ++It)
+    if (!It->isDeclaration())
+      ++Count;
+  return Count;
 }
 
+static bool hasDefinition(Module *M) { return countDefinitions(M) != 0; }
+
 Module *MCJITHelper::getModuleForNewFunction() {
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
+
+  // In lazy mode, each definition is kept in its own module.
+  // Parallel units group several definitions.
+  if (Lazy && OpenModule &&
+      countDefinitions(OpenModule) >= (Threads ? UnitSize : 1))
+    closeOpenModule();
+
   // If we have a Module that hasn't been JITed, use that.
   if (OpenModule)
     return OpenModule;
 
   // Otherwise create a new Module.
-  std::string ModName = GenerateUniqueName("mcjit_module_");
-  Module *M = new Module(ModName, Context);
+  Module *M = new Module(getModuleName(Modules.size()), Context);
   Modules.push_back(M);
   OpenModule = M;
   return M;
 }
 
+std::string MCJITHelper::getModuleName(unsigned Index) {
+  return "mcjit_module_" + std::to_string(Index);
+}
+
+bool MCJITHelper::loadObject(std::unique_ptr<MemoryBuffer> Obj) {
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
+  ErrorOr<std::unique_ptr<object::ObjectFile>> File =
+      object::ObjectFile::createObjectFile(Obj->getMemBufferRef());
+  if (!File)
+    return false;
+
+  // MCJIT needs a module to start from, but all the code is in the object
+  Module *M = new Module(getModuleName(Modules.size()), Context);
+  Modules.push_back(M);
+  ExecutionEngine *NewEngine = createEngine(M, OptLevel, false);
+  NewEngine->addObjectFile(object::OwningBinary<object::ObjectFile>(
+      std::move(*File), std::move(Obj)));
+
+  Engines.push_back(NewEngine);
+  NewEngine->finalizeObject();
+  ObjectEngines.push_back(NewEngine);
+  return true;
+}
+
+std::unique_ptr<Module> MCJITHelper::takeOpenModule() {
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
+  Module *M = OpenModule;
+  OpenModule = NULL;
+  Modules.erase(std::find(Modules.begin(), Modules.end(), M));
+  return std::unique_ptr<Module>(M);
+}
+
 void *MCJITHelper::getPointerToFunction(Function *F) {
-  // See if an existing instance of MCJIT has this function.
-  EngineVector::iterator begin = Engines.begin();
-  EngineVector::iterator end = Engines.end();
-  EngineVector::iterator it;
-  for (it = begin; it != end; ++it) {
-    void *P = (*it)->getPointerToFunction(F);
-    if (P)
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
+
+  // Named functions are compiled with their unit and found in the index
+  if (Threads && F->hasName() && OpenModule && hasDefinition(OpenModule))
+    closeOpenModule();
+
+  // See if an existing instance of MCJIT has this function,
+  // in lazy mode this compiles its module if it's still pending.
+  if (F->hasName())
+    if (void *P = getSymbolAddress(F->getName()))
       return P;
-  }
 
   // If we didn't find the function, see if we can generate it.
   if (OpenModule) {
-    std::string ErrStr;
-    ExecutionEngine *NewEngine =
-        EngineBuilder(std::unique_ptr<Module>(OpenModule))
-            .setErrorStr(&ErrStr)
-            .setMCJITMemoryManager(std::unique_ptr<HelpingMemoryManager>(
-                new HelpingMemoryManager(this)))
-            .create();
-    if (!NewEngine) {
-      fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
-      exit(1);
+    Module *M = OpenModule;
+    OpenModule = NULL;
+    return compileModule(M)->getPointerToFunction(F);
+  }
+  return NULL;
+}
+
+void *MCJITHelper::getSymbolAddress(StringRef Name) {
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
+
+  if (Name.startswith("__ls_"))
+    return getRuntimeSymbolAddress(Name);
+
+  StringMap<FunctionEntry>::iterator It = FunctionIndex.find(Name);
+  if (It == FunctionIndex.end() || !It->second.Defined) {
+    for (ExecutionEngine *EE : ObjectEngines)
+      if (uint64_t Addr = EE->getFunctionAddress(Name.str()))
+        return (void *)Addr;
+    return NULL;
+  }
+
+  // Units compiled in parallel are indexed again, look the function up anew
+  if (!It->second.EE && Threads) {
+    compilePendingModules();
+    return getSymbolAddress(Name);
+  }
+
+  // Entries are never moved by the StringMap, compiling can't invalidate this
+  FunctionEntry &Entry = It->second;
+  if (!Entry.EE)
+    compileModule(Entry.M);
+  if (!Entry.Address)
+    Entry.Address = Entry.EE->getFunctionAddress(Name.str());
+  return (void *)Entry.Address;
+}
+
+void MCJITHelper::setTieredCompilation(bool Enable, uint64_t Threshold) {
+  TierThreshold = Enable ? std::max<uint64_t>(Threshold, 1) : 0;
+  Lazy = Enable;
+}
+
+void MCJITHelper::setParallelCompilation(unsigned NumThreads,
+                                         unsigned FunctionsPerUnit) {
+  Threads = NumThreads;
+  UnitSize = std::max(FunctionsPerUnit, 1u);
+  Lazy = NumThreads != 0;
+  TierThreshold = 0;
+}
+
+bool MCJITHelper::isLazyCallTarget(StringRef FnName) {
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
+
+  // Natives and the runtime are never compiled or replaced
+  if (!Lazy || Natives.count(FnName) || FnName.startswith("__ls_"))
+    return false;
+
+  // Units only link against the stubs, so they never wait on each other
+  if (Threads) {
+    Function *F = OpenModule ? OpenModule->getFunction(FnName) : NULL;
+    return !F || F->isDeclaration();
+  }
+
+  StringMap<FunctionEntry>::iterator It = FunctionIndex.find(FnName);
+  if (It == FunctionIndex.end() || !It->second.Defined)
+    return false;
+  // Tiered functions can be replaced at any time, never call them directly
+  return !It->second.EE || isTieredCompilation();
+}
+
+MCJITHelper::LazyStub &MCJITHelper::getStub(StringRef FnName) {
+  LazyStub &Stub = LazyStubs[FnName];
+  if (!Stub.Helper) {
+    Stub.Helper = this;
+    Stub.Name = FnName.str();
+  }
+  return Stub;
+}
+
+GlobalVariable *MCJITHelper::getLazyStub(StringRef FnName) {
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
+  getStub(FnName);
+
+  // Resolved to the LazyStub by our memory manager when the module is linked
+  std::string StubName = ("__ls_stub_" + FnName).str();
+  if (GlobalVariable *GV = OpenModule->getNamedGlobal(StubName))
+    return GV;
+  return new GlobalVariable(*OpenModule, Type::getInt8PtrTy(Context), false,
+                            GlobalValue::ExternalLinkage, NULL, StubName);
+}
+
+Function *MCJITHelper::getLazyCompileFunction() {
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
+  if (Function *F = OpenModule->getFunction("__ls_lazy_compile"))
+    return F;
+  Type *Int8PtrTy = Type::getInt8PtrTy(Context);
+  FunctionType *FT = FunctionType::get(Int8PtrTy, Int8PtrTy, false);
+  return Function::Create(FT, Function::ExternalLinkage, "__ls_lazy_compile",
+                          OpenModule);
+}
+
+void *MCJITHelper::lazyCompile(LazyStub *Stub) {
+  // Later calls skip straight to the function, until it's tiered up.
+  // Parallel units also call the host's externs through stubs.
+  void *Address = Stub->Helper->getNativeFunction(Stub->Name);
+  if (!Address)
+    Address = Stub->Helper->getSymbolAddress(Stub->Name);
+  if (!Address)
+    Address = (void *)RTDyldMemoryManager::getSymbolAddressInProcess(Stub->Name);
+  if (!Address)
+    report_fatal_error("Lazy compilation of '" + Stub->Name + "' failed!");
+  void *Expected = NULL;
+  if (!Stub->Address.compare_exchange_strong(Expected, Address))
+    return Expected;
+  return Address;
+}
+
+void MCJITHelper::tierUp(LazyStub *Stub) {
+  MCJITHelper *Helper = Stub->Helper;
+  std::lock_guard<std::mutex> Lock(Helper->QueueLock);
+  Helper->HotQueue.push_back(Stub);
+  if (!Helper->Worker.joinable())
+    Helper->Worker = std::thread(&MCJITHelper::recompileHotFunctions, Helper);
+  Helper->QueueCV.notify_one();
+}
+
+void MCJITHelper::recompileHotFunctions() {
+  std::unique_lock<std::mutex> Lock(QueueLock);
+  for (;;) {
+    QueueCV.wait(Lock, [this] { return Stopping || !HotQueue.empty(); });
+    if (Stopping)
+      return;
+    LazyStub *Stub = HotQueue.front();
+    HotQueue.pop_front();
+    Lock.unlock();
+
+    std::shared_ptr<CompilationUnit> Hot;
+    {
+      std::lock_guard<std::recursive_mutex> Guard(CompileLock);
+      Hot = Stub->Hot;
     }
+    // Functions of a module share its unit, only the first one loads it.
+    // The host keeps generating and compiling code in the meantime.
+    if (Hot && !Hot->M)
+      loadUnit(*Hot, 3);
+    if (Hot) {
+      std::lock_guard<std::recursive_mutex> Guard(CompileLock);
+      if (Hot->Context) {
+        generateCode(Hot->M, Hot->EE);
+        Engines.push_back(Hot->EE);
+        UnitContexts.push_back(std::move(Hot->Context));
+      }
+      // Callers already running the tier 0 code finish there
+      Stub->Address.store((void *)Hot->EE->getFunctionAddress(Stub->Name));
+    }
+
+    Lock.lock();
+  }
+}
+
+/// Ends the current block with one more count, then continues to Next. The
+/// atomic increment can't lose counts or skip the threshold when host threads
+/// race, and the single one that reaches it queues the function.
+static void createTierCount(IRBuilder<> &Builder, Constant *Counter,
+                            Constant *Stub, Constant *TierUp,
+                            uint64_t Threshold, BasicBlock *Next) {
+  LLVMContext &Context = Builder.getContext();
+  BasicBlock *Hot = BasicBlock::Create(Context, "tierup",
+                                       Builder.GetInsertBlock()->getParent(),
+                                       Next);
+  Value *Count = Builder.CreateAtomicRMW(AtomicRMWInst::Add, Counter,
+                                         Builder.getInt64(1), Monotonic);
+  Value *IsHot =
+      Builder.CreateICmpEQ(Count, Builder.getInt64(Threshold - 1), "hot");
+  Builder.CreateCondBr(IsHot, Hot, Next,
+                       MDBuilder(Context).createBranchWeights(1, 1000));
+
+  Builder.SetInsertPoint(Hot);
+  Builder.CreateCall(TierUp, Builder.CreateBitCast(Stub, Builder.getInt8PtrTy()));
+  Builder.CreateBr(Next);
+}
 
-    // Create a function pass manager for this engine
-    auto *FPM = new legacy::FunctionPassManager(OpenModule);
-
-    // Set up the optimizer pipeline.  Start with registering info about how the
-    // target lays out data structures.
-    OpenModule->setDataLayout(NewEngine->getDataLayout());
-    FPM->add(new DataLayoutPass());
-    // Provide basic AliasAnalysis support for GVN.
-    FPM->add(createBasicAliasAnalysisPass());
-    // Promote allocas to registers.
-    FPM->add(createPromoteMemoryToRegisterPass());
-    // Do simple "peephole" optimizations and bit-twiddling optzns.
-    FPM->add(createInstructionCombiningPass());
-    // Reassociate expressions.
-    FPM->add(createReassociatePass());
-    // Eliminate Common SubExpressions.
-    FPM->add(createGVNPass());
-    // Simplify the control flow graph (deleting unreachable blocks, etc).
-    FPM->add(createCFGSimplificationPass());
-    FPM->doInitialization();
-
-    // For each function in the module
-    Module::iterator it;
-    Module::iterator end = OpenModule->end();
-    for (it = OpenModule->begin(); it != end; ++it) {
-      // Run the FPM on this function
-      FPM->run(*it);
+void MCJITHelper::instrumentModule(Module *M) {
+  Type *Int8PtrTy = Type::getInt8PtrTy(Context);
+  Type *Int64Ty = Type::getInt64Ty(Context);
+  Constant *TierUp = M->getOrInsertFunction(
+      "__ls_tier_up", Type::getVoidTy(Context), Int8PtrTy, NULL);
+
+  for (Module::iterator F = M->begin(), End = M->end(); F != End; ++F) {
+    if (F->isDeclaration() || !F->hasName())
+      continue;
+
+    // The counter lives in the stub, resolved by name like the stub itself
+    getStub(F->getName());
+    Constant *Counter =
+        M->getOrInsertGlobal(("__ls_count_" + F->getName()).str(), Int64Ty);
+    Constant *Stub =
+        M->getOrInsertGlobal(("__ls_stub_" + F->getName()).str(), Int8PtrTy);
+
+    // Loops count their iterations, so a function that runs a long loop in
+    // few calls gets hot too. Without on-stack replacement, the running call
+    // stays in the tier 0 code and the next ones use the hot code.
+    SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 8> BackEdges;
+    FindFunctionBackedges(*F, BackEdges);
+    for (auto &Edge : BackEdges) {
+      BasicBlock *Header = const_cast<BasicBlock *>(Edge.second);
+      BasicBlock *Latch =
+          SplitEdge(const_cast<BasicBlock *>(Edge.first), Header);
+      // Only the block left with the branch to the header feeds its phis
+      BasicBlock *Next = Latch->splitBasicBlock(Latch->getTerminator(),
+                                                "backedge");
+      Latch->getTerminator()->eraseFromParent();
+      IRBuilder<> Builder(Latch);
+      createTierCount(Builder, Counter, Stub, TierUp, TierThreshold, Next);
     }
 
-    // We don't need this anymore
-    delete FPM;
+    // entry: stub moved on ? forward : count
+    // count: ++count == threshold ? tierup : body
+    BasicBlock *Entry = &F->getEntryBlock();
+    BasicBlock *Body = Entry->splitBasicBlock(Entry->begin(), "body");
+    BasicBlock *Forward = BasicBlock::Create(Context, "forward", &*F, Body);
+    BasicBlock *Counting = BasicBlock::Create(Context, "count", &*F, Body);
+    Entry->getTerminator()->eraseFromParent();
 
-    OpenModule = NULL;
-    Engines.push_back(NewEngine);
-    NewEngine->finalizeObject();
-    return NewEngine->getPointerToFunction(F);
+    // The host keeps direct pointers to the tier 0 code, they must reach the
+    // hot code too once the stub points to it
+    IRBuilder<> Builder(Entry);
+    Value *Target = Builder.CreateLoad(Stub, "target");
+    Value *Moved = Builder.CreateAnd(
+        Builder.CreateIsNotNull(Target),
+        Builder.CreateICmpNE(Target, Builder.CreateBitCast(&*F, Int8PtrTy)),
+        "moved");
+    Builder.CreateCondBr(Moved, Forward, Counting,
+                         MDBuilder(Context).createBranchWeights(1, 1000));
+
+    Builder.SetInsertPoint(Forward);
+    SmallVector<Value *, 8> Args;
+    for (Function::arg_iterator It = F->arg_begin(), End = F->arg_end();
+         It != End; ++It)
+      Args.push_back(&*It);
+    CallInst *Call = Builder.CreateCall(
+        Builder.CreateBitCast(Target, F->getFunctionType()->getPointerTo()),
+        Args);
+    Call->setTailCall();
+    if (F->getReturnType()->isVoidTy())
+      Builder.CreateRetVoid();
+    else
+      Builder.CreateRet(Call);
+
+    Builder.SetInsertPoint(Counting);
+    createTierCount(Builder, Counter, Stub, TierUp, TierThreshold, Body);
   }
-  return NULL;
 }
 
-void *MCJITHelper::getSymbolAddress(const std::string &Name) {
-  // Look for the symbol in each of our execution engines.
-  EngineVector::iterator begin = Engines.begin();
-  EngineVector::iterator end = Engines.end();
-  EngineVector::iterator it;
-  for (it = begin; it != end; ++it) {
-    uint64_t FAddr = (*it)->getFunctionAddress(Name);
-    if (FAddr) {
-      return (void *)FAddr;
-    }
+void MCJITHelper::closeOpenModule() {
+  // The module's definitions are indexed as pending, until first used
+  indexModule(OpenModule, NULL);
+  PendingModules.push_back(OpenModule);
+  OpenModule = NULL;
+}
+
+ExecutionEngine *MCJITHelper::compileModule(Module *M) {
+  // Anything the new module links against must be known to the index
+  if (Lazy && OpenModule && hasDefinition(OpenModule))
+    closeOpenModule();
+  ModuleVector::iterator Pending =
+      std::find(PendingModules.begin(), PendingModules.end(), M);
+  if (Pending != PendingModules.end())
+    PendingModules.erase(Pending);
+
+  // Tier 0 is compiled as fast as possible, but counts its calls. The hot
+  // copy is recompiled on the Worker thread, in its own context like the
+  // parallel units, so it's kept as bitcode.
+  unsigned Level = OptLevel;
+  if (isTieredCompilation()) {
+    std::shared_ptr<CompilationUnit> Hot(new CompilationUnit);
+    Hot->Name = M->getModuleIdentifier() + "_hot";
+    raw_svector_ostream OS(Hot->Bitcode);
+    WriteBitcodeToFile(M, OS);
+    OS.flush();
+    for (Module::iterator It = M->begin(), End = M->end(); It != End; ++It)
+      if (!It->isDeclaration())
+        getStub(It->getName()).Hot = Hot;
+    instrumentModule(M);
+    Level = 0;
+  }
+
+  ExecutionEngine *NewEngine = createEngine(M, Level, false);
+  NewEngine->setObjectCache(Cache);
+
+  // A cached object was already optimized
+  if (!Cache || !Cache->hasObject(M))
+    optimizeModule(M, Level);
+
+  Engines.push_back(NewEngine);
+  generateCode(M, NewEngine);
+  indexModule(M, NewEngine);
+  return NewEngine;
+}
+
+ExecutionEngine *MCJITHelper::createEngine(Module *M, unsigned Level,
+                                           bool Concurrent) {
+  std::string ErrStr;
+  ExecutionEngine *NewEngine =
+      EngineBuilder(std::unique_ptr<Module>(M))
+          .setErrorStr(&ErrStr)
+          .setOptLevel(getCodeGenOptLevel(Level))
+          .setMCJITMemoryManager(std::unique_ptr<HelpingMemoryManager>(
+              new HelpingMemoryManager(this, Concurrent)))
+          .create();
+  if (!NewEngine) {
+    fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
+    exit(1);
+  }
+  M->setDataLayout(NewEngine->getDataLayout());
+  return NewEngine;
+}
+
+void MCJITHelper::compilePendingModules() {
+  if (OpenModule && hasDefinition(OpenModule))
+    closeOpenModule();
+
+  // LLVMContexts aren't thread safe, so each unit is moved to its own through
+  // bitcode. The pending modules and their index entries go away with it.
+  std::vector<CompilationUnit> Units(PendingModules.size());
+  SmallPtrSet<Module *, 16> Moved;
+  for (size_t i = 0; i < Units.size(); ++i) {
+    Module *M = PendingModules[i];
+    raw_svector_ostream OS(Units[i].Bitcode);
+    WriteBitcodeToFile(M, OS);
+    OS.flush();
+    Units[i].Name = M->getModuleIdentifier();
+    Moved.insert(M);
+  }
+  for (StringMap<FunctionEntry>::iterator It = FunctionIndex.begin(),
+                                          End = FunctionIndex.end();
+       It != End;) {
+    StringMap<FunctionEntry>::iterator Cur = It++;
+    if (Moved.count(Cur->second.M))
+      FunctionIndex.erase(Cur);
+  }
+  for (Module *M : PendingModules) {
+    Modules.erase(std::find(Modules.begin(), Modules.end(), M));
+    delete M;
+  }
+  PendingModules.clear();
+
+  std::atomic<size_t> Next(0);
+  auto Work = [&] {
+    for (size_t i = Next++; i < Units.size(); i = Next++)
+      compileUnit(Units[i]);
+  };
+  std::vector<std::thread> Pool;
+  for (unsigned i = 1; i < Threads && i < Units.size(); ++i)
+    Pool.push_back(std::thread(Work));
+  Work();
+  for (std::thread &T : Pool)
+    T.join();
+
+  for (CompilationUnit &Unit : Units) {
+    Modules.push_back(Unit.M);
+    Engines.push_back(Unit.EE);
+    UnitContexts.push_back(std::move(Unit.Context));
+    indexModule(Unit.M, Unit.EE);
+  }
+
+  // Fill the stubs now, rather than on each function's first call
+  for (StringMap<LazyStub>::iterator It = LazyStubs.begin(),
+                                     End = LazyStubs.end();
+       It != End; ++It)
+    if (void *Address = getSymbolAddress(It->first()))
+      It->second.Address.store(Address);
+}
+
+void MCJITHelper::compileUnit(CompilationUnit &Unit) {
+  loadUnit(Unit, OptLevel);
+  generateCode(Unit.M, Unit.EE);
+}
+
+void MCJITHelper::loadUnit(CompilationUnit &Unit, unsigned Level) {
+  Unit.Context.reset(new LLVMContext);
+  ErrorOr<Module *> M = parseBitcodeFile(
+      MemoryBufferRef(StringRef(Unit.Bitcode.data(), Unit.Bitcode.size()),
+                      Unit.Name),
+      *Unit.Context);
+  if (!M)
+    report_fatal_error("Could not read back the bitcode of " + Unit.Name);
+  Unit.M = *M;
+  Unit.M->setModuleIdentifier(Unit.Name);
+
+  Unit.EE = createEngine(Unit.M, Level, true);
+  Unit.EE->setObjectCache(Cache);
+  if (!Cache || !Cache->hasObject(Unit.M))
+    optimizeModule(Unit.M, Level);
+}
+
+void *MCJITHelper::getRuntimeSymbolAddress(StringRef Name) {
+  if (Name == "__ls_lazy_compile")
+    return (void *)&MCJITHelper::lazyCompile;
+  if (Name == "__ls_tier_up")
+    return (void *)&MCJITHelper::tierUp;
+  if (Name == "__ls_profiler")
+    return Prof;
+  if (Name == "__ls_profile")
+    return (void *)&Profiler::record;
+  if (Name == "__ls_string_length")
+    return (void *)&StringRuntime::length;
+  if (Name == "__ls_string_concat")
+    return (void *)&StringRuntime::concat;
+  if (Name == "__ls_string_compare")
+    return (void *)&StringRuntime::compare;
+  if (Name.startswith("__ls_stub_")) {
+    StringMap<LazyStub>::iterator It =
+        LazyStubs.find(Name.substr(strlen("__ls_stub_")));
+    return It == LazyStubs.end() ? NULL : &It->second;
+  }
+  if (Name.startswith("__ls_count_")) {
+    StringMap<LazyStub>::iterator It =
+        LazyStubs.find(Name.substr(strlen("__ls_count_")));
+    return It == LazyStubs.end() ? NULL : &It->second.Count;
   }
   return NULL;
 }
 
+void MCJITHelper::internalizeModule(Module *M) {
+  for (Module::iterator It = M->begin(), End = M->end(); It != End; ++It)
+    if (!It->isDeclaration() && !It->getName().startswith("__ls_") &&
+        std::find(Exports.begin(), Exports.end(), It->getName()) == Exports.end())
+      It->setLinkage(GlobalValue::InternalLinkage);
+}
+
+void *MCJITHelper::getBatchFunction(StringRef FnName) {
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
+  StringMap<void *>::iterator Cached = Batches.find(FnName);
+  if (Cached != Batches.end())
+    return Cached->second;
+
+  // Compiles FnName's module if it's pending, objects loaded from the cache
+  // don't have any IR to copy
+  if (!getSymbolAddress(FnName))
+    return NULL;
+  StringMap<FunctionEntry>::iterator It = FunctionIndex.find(FnName);
+  if (It == FunctionIndex.end() || !It->second.Defined)
+    return NULL;
+
+  // Tier 0 code is instrumented, read back the IR it was made from instead
+  Module *M;
+  StringMap<LazyStub>::iterator Stub = LazyStubs.find(FnName);
+  if (Stub != LazyStubs.end() && Stub->second.Hot) {
+    const SmallVector<char, 0> &Bitcode = Stub->second.Hot->Bitcode;
+    ErrorOr<Module *> Hot = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), FnName),
+        Context);
+    if (!Hot)
+      return NULL;
+    M = *Hot;
+  } else {
+    M = CloneModule(It->second.M);
+  }
+
+  // The copies of the module's definitions are private to the loop's module
+  std::string Name = ("__ls_batch_" + FnName).str();
+  M->setModuleIdentifier(Name);
+  for (Module::iterator F = M->begin(), End = M->end(); F != End; ++F)
+    if (!F->isDeclaration())
+      F->setLinkage(GlobalValue::InternalLinkage);
+  createBatchLoop(M->getFunction(FnName), Name);
+  Modules.push_back(M);
+
+  // Without the object cache, the copy would get its source's object
+  ExecutionEngine *NewEngine = createEngine(M, 3, false);
+  optimizeModule(M, 3);
+  Engines.push_back(NewEngine);
+  generateCode(M, NewEngine);
+
+  void *Address = (void *)NewEngine->getFunctionAddress(Name);
+  Batches[FnName] = Address;
+  return Address;
+}
+
+Function *MCJITHelper::createBatchLoop(Function *F, const std::string &Name) {
+  LLVMContext &C = F->getContext();
+  Type *RetTy = F->getReturnType();
+  Type *Int64Ty = Type::getInt64Ty(C);
+
+  // void Name(i64 N, R *Out, Args *...Columns), void functions ignore Out
+  SmallVector<Type *, 8> Params;
+  Params.push_back(Int64Ty);
+  Params.push_back(RetTy->isVoidTy() ? Type::getInt8PtrTy(C)
+                                     : RetTy->getPointerTo());
+  for (Type *ArgTy : F->getFunctionType()->params())
+    Params.push_back(ArgTy->getPointerTo());
+  Function *Loop = Function::Create(
+      FunctionType::get(Type::getVoidTy(C), Params, false),
+      Function::ExternalLinkage, Name, F->getParent());
+  // The columns don't overlap the output, so the loop can be vectorized
+  for (unsigned i = 2; i <= Params.size(); ++i)
+    Loop->setDoesNotAlias(i);
+
+  BasicBlock *Entry = BasicBlock::Create(C, "entry", Loop);
+  BasicBlock *Body = BasicBlock::Create(C, "loop", Loop);
+  BasicBlock *Exit = BasicBlock::Create(C, "exit", Loop);
+  Function::arg_iterator Arg = Loop->arg_begin();
+  Value *N = &*Arg++;
+  Value *Out = &*Arg++;
+
+  IRBuilder<> Builder(Entry);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(N, Builder.getInt64(0)), Exit,
+                       Body);
+
+  // loop: out[i] = F(columns[i]...) for i in [0, N)
+  Builder.SetInsertPoint(Body);
+  PHINode *I = Builder.CreatePHI(Int64Ty, 2, "i");
+  I->addIncoming(Builder.getInt64(0), Entry);
+  SmallVector<Value *, 8> Args;
+  for (Function::arg_iterator End = Loop->arg_end(); Arg != End; ++Arg)
+    Args.push_back(Builder.CreateLoad(Builder.CreateGEP(&*Arg, I)));
+  Value *Result = Builder.CreateCall(F, Args);
+  if (!RetTy->isVoidTy())
+    Builder.CreateStore(Result, Builder.CreateGEP(Out, I));
+  Value *Next = Builder.CreateNUWAdd(I, Builder.getInt64(1), "next");
+  I->addIncoming(Next, Body);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Next, N), Exit, Body);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return Loop;
+}
+
+CodeGenOpt::Level MCJITHelper::getCodeGenOptLevel() const {
+  return getCodeGenOptLevel(OptLevel);
+}
+
+CodeGenOpt::Level MCJITHelper::getCodeGenOptLevel(unsigned Level) {
+  switch (Level) {
+  case 0:
+    return CodeGenOpt::None;
+  case 1:
+    return CodeGenOpt::Less;
+  case 2:
+    return CodeGenOpt::Default;
+  default:
+    return CodeGenOpt::Aggressive;
+  }
+}
+
+static uint64_t countInstructions(Module *M) {
+  uint64_t Count = 0;
+  for (Module::iterator F = M->begin(), FE = M->end(); F != FE; ++F)
+    for (Function::iterator BB = F->begin(), BE = F->end(); BB != BE; ++BB)
+      Count += BB->size();
+  return Count;
+}
+
+void MCJITHelper::optimizeModule(Module *M) { optimizeModule(M, OptLevel); }
+
+void MCJITHelper::optimizeModule(Module *M, unsigned Level) {
+  if (!Exports.empty())
+    internalizeModule(M);
+
+  // At -O0 the IR goes straight to codegen
+  BackendStats S;
+  S.irInstructionsBefore = S.irInstructionsAfter = countInstructions(M);
+  if (!Level) {
+    addStats(S);
+    return;
+  }
+
+  PassManagerBuilder Builder;
+  Builder.OptLevel = Level;
+  // Inline script functions into their callers. Lazy modules only hold a
+  // single definition, so they can't inline across functions.
+  if (Level > 1)
+    Builder.Inliner = createFunctionInliningPass(Level, 0);
+  Builder.LoopVectorize = Level > 2;
+  Builder.SLPVectorize = Level > 2;
+
+  // Start with registering info about how the target lays out data structures.
+  legacy::FunctionPassManager FPM(M);
+  FPM.add(new DataLayoutPass());
+  Builder.populateFunctionPassManager(FPM);
+  legacy::PassManager MPM;
+  MPM.add(new DataLayoutPass());
+  Builder.populateModulePassManager(MPM);
+
+  // Simplify each function, then the module as a whole (IPSCCP, global DCE, loops...)
+  {
+    PhaseTimer Timer(S.functionPassTime);
+    FPM.doInitialization();
+    for (Module::iterator It = M->begin(), End = M->end(); It != End; ++It)
+      FPM.run(*It);
+    FPM.doFinalization();
+  }
+  {
+    PhaseTimer Timer(S.modulePassTime);
+    MPM.run(*M);
+  }
+  S.irInstructionsAfter = countInstructions(M);
+  addStats(S);
+}
+
+void MCJITHelper::generateCode(Module *M, ExecutionEngine *EE) {
+  BackendStats S;
+  S.modules = 1;
+  {
+    // Or loads the module's object from the cache
+    PhaseTimer Timer(S.codegenTime);
+    EE->generateCodeForModule(M);
+  }
+  {
+    PhaseTimer Timer(S.finalizeTime);
+    EE->finalizeObject();
+  }
+  addStats(S);
+}
+
+void MCJITHelper::addStats(const BackendStats &S) {
+  std::lock_guard<std::mutex> Lock(StatsLock);
+  Stats += S;
+}
+
+BackendStats MCJITHelper::getStats() {
+  std::lock_guard<std::mutex> Lock(StatsLock);
+  return Stats;
+}
+
+void MCJITHelper::indexModule(Module *M, ExecutionEngine *EE) {
+  for (Module::iterator It = M->begin(), End = M->end(); It != End; ++It) {
+    if (!It->hasName())
+      continue;
+
+    // Definitions win over the prototypes that refer to them
+    FunctionEntry &Entry = FunctionIndex[It->getName()];
+    if (!It->isDeclaration())
+      Entry = FunctionEntry{M, EE, 0, true};
+    else if (!Entry.M)
+      Entry = FunctionEntry{M, NULL, 0, false};
+  }
+}
+
 void MCJITHelper::dump() {
+  std::lock_guard<std::recursive_mutex> Lock(CompileLock);
   ModuleVector::iterator begin = Modules.begin();
   ModuleVector::iterator end = Modules.end();
   ModuleVector::iterator it;
@@ -1,31 +1,228 @@
 #ifndef MCJITHELPER_H
 #define MCJITHELPER_H
 
+#include "compilestats.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string>
 
+class ObjectFileCache;
+class Profiler;
+
 class MCJITHelper {
 public:
-  MCJITHelper(llvm::LLVMContext &C) : Context(C), OpenModule(NULL) {}
+  MCJITHelper(llvm::LLVMContext &C)
+      : Context(C), OpenModule(NULL), Cache(NULL), Prof(NULL), OptLevel(1),
+        TierThreshold(0), Threads(0), UnitSize(1), Lazy(false),
+        NameCounter(0), Stopping(false) {}
   ~MCJITHelper();
 
-  llvm::Function *getFunction(const std::string FnName);
+  llvm::Function *getFunction(llvm::StringRef FnName);
   llvm::Module *getModuleForNewFunction();
   void *getPointerToFunction(llvm::Function *F);
-  void *getSymbolAddress(const std::string &Name);
+  void *getSymbolAddress(llvm::StringRef Name);
   void dump();
 
+  /// Gives up the module that would be JITed next, for ahead of time compilation
+  std::unique_ptr<llvm::Module> takeOpenModule();
+  /// Runs the pipeline of the OptLevel, the module's data layout must be set.
+  /// In whole script mode, internalizes the functions that aren't exported first.
+  void optimizeModule(llvm::Module *M);
+
+  /// From 0 to 3, like -O. Applies to the IR passes and MCJIT's own codegen.
+  void setOptLevel(unsigned Level) { OptLevel = Level; }
+  unsigned getOptLevel() const { return OptLevel; }
+  llvm::CodeGenOpt::Level getCodeGenOptLevel() const;
+
+  /// Modules are named after their position, so a script always gets the
+  /// same names and can find its objects in the cache.
+  static std::string getModuleName(unsigned Index);
+  /// Objects are loaded from and saved to the Cache, which must outlive us.
+  void setObjectCache(ObjectFileCache *C) { Cache = C; }
+  /// Loads an object file emitted for a previous module, its symbols are
+  /// found by getSymbolAddress.
+  bool loadObject(std::unique_ptr<llvm::MemoryBuffer> Obj);
+
+  /// Whole script mode: functions not in the list get internal linkage before
+  /// their module is optimized, so they can be inlined and removed. Only the
+  /// exported functions can be looked up once compiled.
+  void setExportedFunctions(const std::vector<std::string> &Names) {
+    Exports = Names;
+  }
+
+  /// In lazy mode every definition gets its own module, which is only
+  /// compiled when one of its functions is first called or looked up.
+  /// Must be set before any function is generated, and disabling it also
+  /// disables tiered and parallel compilation.
+  void setLazyCompilation(bool Enable) {
+    Lazy = Enable;
+    if (!Enable)
+      TierThreshold = Threads = 0;
+  }
+  bool isLazyCompilation() const { return Lazy; }
+
+  /// Tiered mode is a lazy mode where functions are first compiled at -O0,
+  /// counting their calls. After Threshold calls, a function is recompiled
+  /// at -O3 in the background and its stub is repointed to the new code.
+  void setTieredCompilation(bool Enable, uint64_t Threshold);
+  bool isTieredCompilation() const { return TierThreshold != 0; }
+  uint64_t getTierThreshold() const { return TierThreshold; }
+  unsigned getUnitSize() const { return Threads ? UnitSize : 0; }
+
+  /// Parallel mode splits the script in units of FunctionsPerUnit definitions,
+  /// optimized and compiled on NumThreads threads, each in its own context.
+  /// Calls between units go through stubs. All pending units are compiled at
+  /// once, the first time a function is looked up. 0 threads disables it.
+  void setParallelCompilation(unsigned NumThreads, unsigned FunctionsPerUnit);
+
+  /// Calls to the extern Name are linked to Address, it's never looked up in
+  /// the process. Must be added before any function is generated.
+  void addNativeFunction(llvm::StringRef Name, void *Address) {
+    Natives[Name] = Address;
+  }
+  /// Doesn't lock, natives don't change once compiling started
+  void *getNativeFunction(llvm::StringRef Name) const {
+    llvm::StringMap<void *>::const_iterator It = Natives.find(Name);
+    return It == Natives.end() ? NULL : It->second;
+  }
+
+  /// Script functions get probes recording in P, which must outlive us.
+  /// Must be set before any function is generated.
+  void setProfiler(Profiler *P) { Prof = P; }
+  Profiler *getProfiler() const { return Prof; }
+
+  /// Resolves the stubs and runtime functions of the JITed code, without
+  /// locking, for units being compiled concurrently.
+  void *getRuntimeSymbolAddress(llvm::StringRef Name);
+
+  /// True if calls to FnName must go through its lazy stub, because it is
+  /// defined in a module that hasn't been compiled yet, or could be tiered up.
+  bool isLazyCallTarget(llvm::StringRef FnName);
+  /// The stub's first word holds FnName's address once it's compiled, or NULL.
+  llvm::GlobalVariable *getLazyStub(llvm::StringRef FnName);
+  /// Takes a stub, compiles its function if needed and returns its address.
+  llvm::Function *getLazyCompileFunction();
+
+  /// Compiles void(i64 N, R *Out, Args *...Columns), which stores FnName's
+  /// result for each row of its argument columns in Out. FnName's module is
+  /// copied and optimized at -O3 with the loop, so FnName can be inlined and
+  /// the loop vectorized. NULL if FnName's IR isn't available.
+  void *getBatchFunction(llvm::StringRef FnName);
+
+  /// Optimization and codegen statistics of all the modules compiled so far
+  BackendStats getStats();
+
 private:
+  friend class HelpingMemoryManager;
+
   typedef std::vector<llvm::Module *> ModuleVector;
   typedef std::vector<llvm::ExecutionEngine *> EngineVector;
 
+  /// Where a function of an already JITed module lives
+  struct FunctionEntry {
+    llvm::Module *M;           ///< Module defining it, or declaring it if none does
+    llvm::ExecutionEngine *EE; ///< Engine of the defining module, NULL for externs
+    uint64_t Address;          ///< Cached once resolved
+    bool Defined;              ///< Still pending if EE is NULL
+  };
+
+  /// A module moved to its own context to be compiled on a worker thread
+  struct CompilationUnit {
+    CompilationUnit() : M(NULL), EE(NULL) {}
+
+    std::string Name;
+    llvm::SmallVector<char, 0> Bitcode;
+    std::unique_ptr<llvm::LLVMContext> Context; ///< Given to UnitContexts once linked
+    llvm::Module *M;
+    llvm::ExecutionEngine *EE;
+  };
+
+  /// Target of the lazy stubs, called from JITed code.
+  struct LazyStub {
+    LazyStub() : Address(NULL), Helper(NULL), Count(0) {}
+
+    std::atomic<void *> Address; ///< Must stay first, JITed code loads it
+    MCJITHelper *Helper;
+    std::string Name;
+    /// Calls and loop iterations of the tier 0 code, incremented atomically
+    uint64_t Count;
+    /// Uninstrumented bitcode of the function's module, recompiled once hot
+    std::shared_ptr<CompilationUnit> Hot;
+  };
+
+  /// Names are only unique within this helper, helpers don't share anything
+  std::string generateUniqueName(const char *Root);
+  std::string makeLegalFunctionName(std::string Name);
+  LazyStub &getStub(llvm::StringRef FnName);
+  static void *lazyCompile(LazyStub *Stub);
+  static void tierUp(LazyStub *Stub);
+  void recompileHotFunctions();
+  void instrumentModule(llvm::Module *M);
+  static llvm::Function *createBatchLoop(llvm::Function *F,
+                                         const std::string &Name);
+  void closeOpenModule();
+  void internalizeModule(llvm::Module *M);
+  llvm::ExecutionEngine *createEngine(llvm::Module *M, unsigned Level,
+                                      bool Concurrent);
+  llvm::ExecutionEngine *compileModule(llvm::Module *M);
+  void compilePendingModules();
+  void compileUnit(CompilationUnit &Unit);
+  /// Reads the unit back in its own context and optimizes it, without
+  /// locking. It still has to go through generateCode.
+  void loadUnit(CompilationUnit &Unit, unsigned Level);
+  void optimizeModule(llvm::Module *M, unsigned Level);
+  void generateCode(llvm::Module *M, llvm::ExecutionEngine *EE);
+  void addStats(const BackendStats &S);
+  static llvm::CodeGenOpt::Level getCodeGenOptLevel(unsigned Level);
+  void indexModule(llvm::Module *M, llvm::ExecutionEngine *EE);
+
   llvm::LLVMContext &Context;
   llvm::Module *OpenModule;
   ModuleVector Modules;
+  ModuleVector PendingModules; ///< Lazy modules not owned by an engine yet
   EngineVector Engines;
+  EngineVector ObjectEngines; ///< Engines of the objects loaded directly
+  llvm::StringMap<FunctionEntry> FunctionIndex;
+  llvm::StringMap<LazyStub> LazyStubs;
+  llvm::StringMap<void *> Natives;
+  llvm::StringMap<void *> Batches; ///< Batch loops by function name
+  ObjectFileCache *Cache;
+  Profiler *Prof; ///< NULL unless profiling
+  std::vector<std::string> Exports; ///< Empty unless in whole script mode
+  unsigned OptLevel;
+  uint64_t TierThreshold; ///< 0 unless in tiered mode
+  unsigned Threads;       ///< 0 unless in parallel mode
+  unsigned UnitSize;
+  bool Lazy;
+  unsigned NameCounter;
+  /// Contexts of the parallel units, after the Engines that use them
+  std::vector<std::unique_ptr<llvm::LLVMContext>> UnitContexts;
+
+  /// Guards the modules, the index and the stubs. Hot functions are read back
+  /// and optimized in their own context on the Worker thread, which only
+  /// holds it to link them.
+  std::recursive_mutex CompileLock;
+  std::thread Worker;
+  std::mutex QueueLock;
+  std::condition_variable QueueCV;
+  std::deque<LazyStub *> HotQueue;
+  bool Stopping;
+
+  std::mutex StatsLock;
+  BackendStats Stats;
 };
 
 class HelpingMemoryManager : public llvm::SectionMemoryManager {
@@ -33,17 +230,24 @@ class HelpingMemoryManager : public llvm::SectionMemoryManager {
   void operator=(const HelpingMemoryManager &) = delete;
 
 public:
-  HelpingMemoryManager(MCJITHelper *Helper) : MasterHelper(Helper) {}
+  HelpingMemoryManager(MCJITHelper *Helper, bool Concurrent)
+      : MasterHelper(Helper), Concurrent(Concurrent) {}
   virtual ~HelpingMemoryManager() {}
 
   /// This method returns the address of the specified symbol.
-  /// Our implementation will attempt to find symbols in other
+  /// Our implementation will first look for symbols in other
   /// modules associated with the MCJITHelper to cross link symbols
-  /// from one generated module to another.
+  /// from one generated module to another, then in the process.
   virtual uint64_t getSymbolAddress(const std::string &Name) override;
 
+  /// Counts the machine code emitted in the helper's stats
+  virtual uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                                       unsigned SectionID,
+                                       llvm::StringRef SectionName) override;
+
 private:
   MCJITHelper *MasterHelper;
+  bool Concurrent; ///< Only resolves runtime symbols through the helper
 };
 
 #endif // MCJITHELPER_H
@@ -0,0 +1,51 @@
+#ifndef NATIVETYPE_H
+#define NATIVETYPE_H
+
+#include <cstdint>
+#include <llvm/IR/DerivedTypes.h>
+
+/// The LLVM type of the script values held in a T.
+/// Only defined for the types of script values: int64_t, double, const char*, bool and void.
+template <class T> struct NativeType;
+
+template <> struct NativeType<int64_t>
+{
+    static llvm::Type* get(llvm::LLVMContext& c) { return llvm::Type::getInt64Ty(c); }
+};
+
+template <> struct NativeType<double>
+{
+    static llvm::Type* get(llvm::LLVMContext& c) { return llvm::Type::getDoubleTy(c); }
+};
+
+/// Script strings are length-prefixed, a const char* crossing into the script must be a script string:
+/// made by the StringRuntime, or received from the script. Plain C strings are read out of bounds.
+template <> struct NativeType<const char*>
+{
+    static llvm::Type* get(llvm::LLVMContext& c) { return llvm::Type::getInt8PtrTy(c); }
+};
+
+template <> struct NativeType<bool>
+{
+    static llvm::Type* get(llvm::LLVMContext& c) { return llvm::Type::getInt1Ty(c); }
+};
+
+template <> struct NativeType<void>
+{
+    static llvm::Type* get(llvm::LLVMContext& c) { return llvm::Type::getVoidTy(c); }
+};
+
+/// The type of script functions with the C++ signature F, like bool(int64_t, double)
+template <class F> struct NativeFunctionType;
+
+template <class R, class... Args> struct NativeFunctionType<R(Args...)>
+{
+    static llvm::FunctionType* get(llvm::LLVMContext& c)
+    {
+        // The null keeps the array valid without arguments
+        llvm::Type* args[] = {NativeType<Args>::get(c)..., nullptr};
+        return llvm::FunctionType::get(NativeType<R>::get(c), llvm::makeArrayRef(args, sizeof...(Args)), false);
+    }
+};
+
+#endif // NATIVETYPE_H
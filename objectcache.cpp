@@ -0,0 +1,114 @@
+#include "objectcache.h"
+#include <llvm/IR/Module.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+
+ObjectFileCache::ObjectFileCache(StringRef Dir, StringRef Key)
+    : dir{Dir.str()}, key{Key.str()}
+{
+    sys::fs::create_directories(dir);
+}
+
+std::string ObjectFileCache::makeKey(StringRef script, StringRef settings)
+{
+    // Every part is null terminated, so moving bytes between them changes the key
+    std::string triple = sys::getProcessTriple();
+    MD5 hash;
+    for (StringRef part : {script, settings, StringRef{LLVM_VERSION_STRING},
+                           StringRef{triple}, sys::getHostCPUName()})
+    {
+        hash.update(part);
+        hash.update(ArrayRef<uint8_t>{0});
+    }
+
+    MD5::MD5Result result;
+    hash.final(result);
+    SmallString<32> str;
+    MD5::stringifyResult(result, str);
+    return str.str().str();
+}
+
+/// Appended to every file, so a short write or a truncated file never passes for a valid entry
+static std::string getChecksum(StringRef data)
+{
+    MD5 hash;
+    hash.update(data);
+    MD5::MD5Result result;
+    hash.final(result);
+    return std::string((const char*)&result[0], sizeof(result));
+}
+
+std::string ObjectFileCache::getPath(StringRef name) const
+{
+    SmallString<128> path{dir};
+    sys::path::append(path, Twine{key} + "-" + name);
+    return path.str().str();
+}
+
+void ObjectFileCache::notifyObjectCompiled(const Module* M, MemoryBufferRef obj)
+{
+    saveFile(M->getModuleIdentifier() + ".o", obj.getBuffer());
+}
+
+void ObjectFileCache::saveFile(StringRef name, StringRef data)
+{
+    std::string path = getPath(name);
+
+    // Other processes may be reading the same entry, write it aside and rename it in place
+    int fd;
+    SmallString<128> tmpPath;
+    if (sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, tmpPath))
+        return;
+    bool failed;
+    {
+        raw_fd_ostream out{fd, true};
+        out << data << getChecksum(data);
+        out.close();
+        // Cleared, or the stream's destructor aborts
+        failed = out.has_error();
+        out.clear_error();
+    }
+    if (failed || sys::fs::rename(tmpPath.str(), path))
+        sys::fs::remove(tmpPath.str());
+}
+
+std::unique_ptr<MemoryBuffer> ObjectFileCache::getObject(const Module* M)
+{
+    return getObject(M->getModuleIdentifier());
+}
+
+std::unique_ptr<MemoryBuffer> ObjectFileCache::getObject(StringRef moduleID)
+{
+    return getFile((moduleID + ".o").str());
+}
+
+std::unique_ptr<MemoryBuffer> ObjectFileCache::getFile(StringRef name)
+{
+    std::string path = getPath(name);
+    ErrorOr<std::unique_ptr<MemoryBuffer>> file = MemoryBuffer::getFile(path);
+    if (!file)
+        return nullptr;
+
+    StringRef contents = (*file)->getBuffer();
+    size_t checksumSize = getChecksum("").size();
+    if (contents.size() < checksumSize)
+        return nullptr;
+    StringRef data = contents.drop_back(checksumSize);
+    if (contents.substr(data.size()) != getChecksum(data))
+        return nullptr;
+    return MemoryBuffer::getMemBufferCopy(data, path);
+}
+
+bool ObjectFileCache::hasObject(const Module* M)
+{
+    // The object is only skipped if it's intact, otherwise M is optimized and compiled again
+    return getObject(M) != nullptr;
+}
@@ -0,0 +1,36 @@
+#ifndef OBJECTCACHE_H
+#define OBJECTCACHE_H
+
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/ADT/StringRef.h>
+#include <memory>
+#include <string>
+
+/// Keeps the object files emitted by MCJIT on disk, so a restart with the same script,
+/// settings and CPU can load them instead of optimizing and compiling everything again.
+class ObjectFileCache : public llvm::ObjectCache
+{
+public:
+    ObjectFileCache(llvm::StringRef Dir, llvm::StringRef Key);
+
+    /// Hashes the script with the settings that change the generated code and the host CPU
+    static std::string makeKey(llvm::StringRef script, llvm::StringRef settings);
+
+    void notifyObjectCompiled(const llvm::Module* M, llvm::MemoryBufferRef obj) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* M) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(llvm::StringRef moduleID);
+    bool hasObject(const llvm::Module* M); ///< Whether compiling M will be a cache hit, reads the whole object
+    /// Other data kept with the objects under the same key, like the signatures of the script's functions.
+    /// Files are stored with a checksum, getFile returns null if it doesn't match.
+    void saveFile(llvm::StringRef name, llvm::StringRef data);
+    std::unique_ptr<llvm::MemoryBuffer> getFile(llvm::StringRef name);
+
+private:
+    std::string getPath(llvm::StringRef name) const;
+
+private:
+    std::string dir;
+    std::string key;
+};
+
+#endif // OBJECTCACHE_H
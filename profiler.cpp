@@ -0,0 +1,102 @@
+#include "profiler.h"
+
+using namespace std;
+
+static atomic<uint64_t> nextSerial{1};
+
+Profiler::Profiler()
+    : serial{nextSerial++}
+{
+}
+
+uint32_t Profiler::addFunction(const string& name)
+{
+    lock_guard<mutex> guard{lock};
+    names.push_back(name);
+    baseCalls.push_back(0);
+    baseCycles.push_back(0);
+    return names.size() - 1;
+}
+
+void Profiler::record(Profiler* profiler, uint32_t id, uint64_t cycles)
+{
+    // Threads usually run a single script, the last table used is almost always the right one
+    struct CachedTable
+    {
+        uint64_t serial;
+        ThreadTable* table;
+    };
+    static thread_local vector<CachedTable> cache;
+    if (cache.empty() || cache.back().serial != profiler->serial)
+    {
+        auto it = cache.begin();
+        while (it != cache.end() && it->serial != profiler->serial)
+            ++it;
+        CachedTable cached = it != cache.end() ? *it : CachedTable{profiler->serial, profiler->getThreadTable()};
+        if (it != cache.end())
+            cache.erase(it);
+        cache.push_back(cached);
+    }
+
+    ThreadTable* table = cache.back().table;
+    if (id >= table->size)
+        profiler->grow(table);
+
+    // We're the only writer, no need for a locked read-modify-write
+    Counter& counter = table->counters[id];
+    counter.calls.store(counter.calls.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    counter.cycles.store(counter.cycles.load(memory_order_relaxed) + cycles, memory_order_relaxed);
+}
+
+Profiler::ThreadTable* Profiler::getThreadTable()
+{
+    lock_guard<mutex> guard{lock};
+    thread::id self = this_thread::get_id();
+    for (unique_ptr<ThreadTable>& table : tables)
+        if (table->thread == self)
+            return table.get();
+
+    tables.emplace_back(new ThreadTable{self, unique_ptr<Counter[]>{new Counter[names.size()]}, (uint32_t)names.size()});
+    return tables.back().get();
+}
+
+void Profiler::grow(ThreadTable* table)
+{
+    lock_guard<mutex> guard{lock};
+    unique_ptr<Counter[]> counters{new Counter[names.size()]};
+    for (uint32_t i = 0; i < table->size; ++i)
+    {
+        counters[i].calls.store(table->counters[i].calls.load(memory_order_relaxed), memory_order_relaxed);
+        counters[i].cycles.store(table->counters[i].cycles.load(memory_order_relaxed), memory_order_relaxed);
+    }
+    table->counters = move(counters);
+    table->size = names.size();
+}
+
+vector<uint64_t> Profiler::sum(atomic<uint64_t> Counter::* field) const
+{
+    vector<uint64_t> totals(names.size());
+    for (const unique_ptr<ThreadTable>& table : tables)
+        for (uint32_t i = 0; i < table->size; ++i)
+            totals[i] += (table->counters[i].*field).load(memory_order_relaxed);
+    return totals;
+}
+
+vector<FunctionProfile> Profiler::read() const
+{
+    lock_guard<mutex> guard{lock};
+    vector<uint64_t> calls = sum(&Counter::calls);
+    vector<uint64_t> cycles = sum(&Counter::cycles);
+
+    vector<FunctionProfile> profile;
+    for (size_t i = 0; i < names.size(); ++i)
+        profile.push_back(FunctionProfile{names[i], calls[i] - baseCalls[i], cycles[i] - baseCycles[i]});
+    return profile;
+}
+
+void Profiler::reset()
+{
+    lock_guard<mutex> guard{lock};
+    baseCalls = sum(&Counter::calls);
+    baseCycles = sum(&Counter::cycles);
+}
@@ -0,0 +1,64 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Calls of a script function and the cycles spent in them, callees included
+struct FunctionProfile
+{
+    std::string name;
+    uint64_t calls;
+    uint64_t cycles;
+};
+
+/// Collects what the probes of the script functions measure.
+/// Each thread running script code records in its own table, so recording never locks or
+/// contends with other threads. Reading sums up the tables of all the threads.
+class Profiler
+{
+public:
+    Profiler();
+
+    /// Returns the id that the function's probes pass to record()
+    uint32_t addFunction(const std::string& name);
+    /// Called by the exit probe of script functions, on any thread
+    static void record(Profiler* profiler, uint32_t id, uint64_t cycles);
+
+    std::vector<FunctionProfile> read() const;
+    void reset();
+
+private:
+    struct Counter
+    {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> cycles{0};
+    };
+
+    /// Only its thread writes the counters, the lock is only taken to replace them with a larger array
+    struct ThreadTable
+    {
+        std::thread::id thread;
+        std::unique_ptr<Counter[]> counters;
+        uint32_t size;
+    };
+
+    ThreadTable* getThreadTable();
+    void grow(ThreadTable* table);
+    std::vector<uint64_t> sum(std::atomic<uint64_t> Counter::* field) const; ///< Must hold the lock
+
+private:
+    const uint64_t serial; ///< Identifies the profiler in the threads' caches, even at a reused address
+    mutable std::mutex lock;
+    std::vector<std::string> names;
+    std::vector<std::unique_ptr<ThreadTable>> tables;
+    /// Totals at the last reset. Other threads' counters can't be cleared without racing with them.
+    std::vector<uint64_t> baseCalls, baseCycles;
+};
+
+#endif // PROFILER_H
@@ -0,0 +1,49 @@
+#ifndef SCRIPTFUNCTION_H
+#define SCRIPTFUNCTION_H
+
+#include <cstdint>
+
+template <class F> class ScriptFunction;
+
+/// A compiled script function with the signature R(Args...), see Lightscript::get.
+/// Calling it is a plain call through a function pointer, there is no lookup or check left.
+template <class R, class... Args>
+class ScriptFunction<R(Args...)>
+{
+public:
+    typedef R (*Pointer)(Args...);
+
+    ScriptFunction() : fn{nullptr} {}
+    explicit ScriptFunction(void* address) : fn{(Pointer)address} {}
+
+    R operator()(Args... args) const { return fn(args...); }
+    explicit operator bool() const { return fn != nullptr; } ///< False if the lookup failed
+    Pointer get() const { return fn; }
+
+private:
+    Pointer fn;
+};
+
+template <class F> class ScriptBatch;
+
+/// Runs a script function with the signature R(Args...) over columns of arguments, see Lightscript::getBatch.
+/// For void functions, out is ignored and can be null.
+template <class R, class... Args>
+class ScriptBatch<R(Args...)>
+{
+public:
+    typedef void (*Pointer)(uint64_t, R*, const Args*...);
+
+    ScriptBatch() : fn{nullptr} {}
+    explicit ScriptBatch(void* address) : fn{(Pointer)address} {}
+
+    /// out[i] = f(columns[i]...) for each of the n rows
+    void operator()(uint64_t n, R* out, const Args*... columns) const { fn(n, out, columns...); }
+    explicit operator bool() const { return fn != nullptr; } ///< False if the lookup failed
+    Pointer get() const { return fn; }
+
+private:
+    Pointer fn;
+};
+
+#endif // SCRIPTFUNCTION_H
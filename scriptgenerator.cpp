@@ -0,0 +1,94 @@
+#include "scriptgenerator.h"
+#include <random>
+
+using namespace std;
+
+namespace
+{
+
+class ScriptWriter
+{
+public:
+    ScriptWriter(const ScriptShape& Shape) : shape(Shape), rng{Shape.seed} {}
+
+    string write()
+    {
+        // The host functions are resolved in the process, the others are never called
+        out += "extern int labs(int a)\nextern float fabs(float a)\n";
+        for (unsigned i = 2; i < shape.externs; ++i)
+            out += "extern int host" + to_string(i) + "(int a, float b, string c, bool d)\n";
+        out += "\n";
+
+        for (unsigned i = 0; i < shape.functions; ++i)
+            writeFunction(i);
+
+        out += "bool init()\n{\n";
+        if (shape.functions)
+            out += "\tf" + to_string(shape.functions - 1) + "(1, 2);\n";
+        out += "\ttrue\n}\n\nvoid exit()\n{\n\n}\n";
+        return out;
+    }
+
+private:
+    void writeFunction(unsigned index)
+    {
+        out += "int f" + to_string(index) + "(int a, int b)\n{\n";
+        for (unsigned i = 0; i < shape.statements; ++i)
+        {
+            out += "\t";
+            writeStatement();
+            out += ";\n";
+        }
+
+        out += "\t";
+        writeIf(index, shape.ifDepth, 1);
+        out += "\n}\n\n";
+    }
+
+    void writeStatement()
+    {
+        switch (rng() % 5)
+        {
+            case 0: out += "a*" + literal() + " + b - " + literal(); break;
+            case 1: out += "(a - " + literal() + ")*(b + " + literal() + ")"; break;
+            case 2: out += "labs(a - " + literal() + ")"; break;
+            case 3: out += "fabs(a*1.5 - b)"; break;
+            case 4: out += "\"" + string(shape.literalSize, 'a' + rng() % 26) + "\""; break;
+        }
+    }
+
+    /// Both branches end with an int, so the nest is the definition's value
+    void writeIf(unsigned index, unsigned depth, unsigned indent)
+    {
+        if (!depth)
+        {
+            out += index ? "f" + to_string(index - 1) + "(a + 1, b) + " + literal() : "a + b";
+            return;
+        }
+
+        string tabs(indent, '\t');
+        out += "if (a < " + literal() + ")\n" + tabs + "{\n" + tabs + "\t";
+        writeIf(index, depth - 1, indent + 1);
+        out += "\n" + tabs + "}\n" + tabs + "else\n" + tabs + "{\n" + tabs + "\t";
+        writeIf(index, depth - 1, indent + 1);
+        out += "\n" + tabs + "}";
+    }
+
+    /// Up to 18 digits, so it still fits in an int
+    string literal()
+    {
+        return to_string(rng() % 1000000000000000000ull);
+    }
+
+private:
+    const ScriptShape& shape;
+    mt19937_64 rng;
+    string out;
+};
+
+}
+
+string generateScript(const ScriptShape& shape)
+{
+    return ScriptWriter{shape}.write();
+}
@@ -0,0 +1,22 @@
+#ifndef SCRIPTGENERATOR_H
+#define SCRIPTGENERATOR_H
+
+#include <cstdint>
+#include <string>
+
+/// What a generated script is made of. Each definition takes two ints, and calls the previous one.
+struct ScriptShape
+{
+    unsigned functions = 100;
+    unsigned statements = 8; ///< Expressions before each definition's if nest
+    unsigned ifDepth = 2;
+    unsigned externs = 4; ///< Declared, only labs and fabs are actually called
+    unsigned literalSize = 16; ///< Characters in each string literal
+    uint32_t seed = 1;
+};
+
+/// Writes a valid script of the given shape, the same shape always gives the same script.
+/// Its init() runs every definition once.
+std::string generateScript(const ScriptShape& shape);
+
+#endif // SCRIPTGENERATOR_H
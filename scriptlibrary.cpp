@@ -0,0 +1,51 @@
+#include "scriptlibrary.h"
+#include <cstdio>
+#include <string>
+#include <dlfcn.h>
+
+ScriptLibrary::ScriptLibrary()
+    : handle{0}, initPtr{0}, exitPtr{0}
+{
+}
+
+ScriptLibrary::~ScriptLibrary()
+{
+    if (handle)
+        dlclose(handle);
+}
+
+bool ScriptLibrary::load(const char* path)
+{
+    // Scripts only ever call into the host, keep their symbols to ourselves
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        fprintf(stderr, "Could not load %s: %s\n", path, dlerror());
+        return false;
+    }
+
+    initPtr = (bool(*)())getFunction("init");
+    exitPtr = (void(*)())getFunction("exit");
+    if (!initPtr || !exitPtr)
+    {
+        fprintf(stderr, "%s is not a compiled script, it must export init and exit\n", path);
+        return false;
+    }
+    return true;
+}
+
+bool ScriptLibrary::init()
+{
+    return initPtr();
+}
+
+void ScriptLibrary::exit()
+{
+    exitPtr();
+}
+
+void* ScriptLibrary::getFunction(const char* name)
+{
+    std::string symbol = std::string{AOT_SYMBOL_PREFIX} + name;
+    return dlsym(handle, symbol.c_str());
+}
@@ -0,0 +1,27 @@
+#ifndef SCRIPTLIBRARY_H
+#define SCRIPTLIBRARY_H
+
+/// Prefix of the functions exported by a script compiled ahead of time
+#define AOT_SYMBOL_PREFIX "lightscript_"
+
+/// Runs a script compiled ahead of time by Lightscript::compileToSharedLibrary.
+/// Only the dynamic loader is needed, so hosts can run scripts without linking LLVM.
+/// The script's externs are resolved against the host's own exported symbols (link it with -rdynamic).
+class ScriptLibrary
+{
+public:
+    ScriptLibrary();
+    ~ScriptLibrary(); ///< Unloads the script, without calling exit()
+
+    bool load(const char* path); ///< Checks that the script has its init and exit functions
+    bool init();
+    void exit();
+    void* getFunction(const char* name); ///< Address of a script function, or 0
+
+private:
+    void* handle;
+    bool (*initPtr)();
+    void (*exitPtr)();
+};
+
+#endif // SCRIPTLIBRARY_H
@@ -0,0 +1,115 @@
+#include "stringruntime.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+
+/// Chunks are kept across resets, only strings larger than a chunk get their own allocation
+struct Arena
+{
+    static const size_t chunkSize = 64 * 1024;
+
+    vector<unique_ptr<char[]>> chunks;
+    vector<unique_ptr<char[]>> large;
+    size_t next = 0; ///< Chunk to fill once the current one is full
+    char* top = nullptr; ///< Start of the free bytes
+    size_t left = 0; ///< Bytes left in the current chunk
+};
+
+thread_local Arena arena;
+
+}
+
+char* StringRuntime::allocate(int64_t length)
+{
+    size_t size = (sizeof(int64_t) + length + 1 + alignof(int64_t) - 1) & ~(alignof(int64_t) - 1);
+    char* base;
+    if (size > Arena::chunkSize)
+    {
+        arena.large.emplace_back(new char[size]);
+        base = arena.large.back().get();
+    }
+    else
+    {
+        if (size > arena.left)
+        {
+            if (arena.next == arena.chunks.size())
+                arena.chunks.emplace_back(new char[Arena::chunkSize]);
+            arena.top = arena.chunks[arena.next++].get();
+            arena.left = Arena::chunkSize;
+        }
+        base = arena.top;
+        arena.top += size;
+        arena.left -= size;
+    }
+
+    memcpy(base, &length, sizeof(length));
+    char* str = base + sizeof(int64_t);
+    str[length] = '\0';
+    return str;
+}
+
+const char* StringRuntime::make(const char* str, int64_t length)
+{
+    char* copy = allocate(length);
+    memcpy(copy, str, length);
+    return copy;
+}
+
+const char* StringRuntime::make(const char* str)
+{
+    return make(str, strlen(str));
+}
+
+int64_t StringRuntime::length(const char* str)
+{
+    int64_t length;
+    memcpy(&length, str - sizeof(int64_t), sizeof(length));
+    return length;
+}
+
+const char* StringRuntime::concat(const char* a, const char* b)
+{
+    int64_t lengthA = length(a), lengthB = length(b);
+    char* str = allocate(lengthA + lengthB);
+    memcpy(str, a, lengthA);
+    memcpy(str + lengthA, b, lengthB);
+    return str;
+}
+
+int64_t StringRuntime::compare(const char* a, const char* b)
+{
+    int64_t lengthA = length(a), lengthB = length(b);
+    if (int result = memcmp(a, b, min(lengthA, lengthB)))
+        return result;
+    return lengthA < lengthB ? -1 : lengthA > lengthB;
+}
+
+// The JIT resolves these itself, scripts compiled ahead of time find them in the host
+extern "C" int64_t __ls_string_length(const char* str)
+{
+    return StringRuntime::length(str);
+}
+
+extern "C" const char* __ls_string_concat(const char* a, const char* b)
+{
+    return StringRuntime::concat(a, b);
+}
+
+extern "C" int64_t __ls_string_compare(const char* a, const char* b)
+{
+    return StringRuntime::compare(a, b);
+}
+
+void StringRuntime::reset()
+{
+    arena.large.clear();
+    arena.next = 0;
+    arena.top = nullptr;
+    arena.left = 0;
+}
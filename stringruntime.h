@@ -0,0 +1,31 @@
+#ifndef STRINGRUNTIME_H
+#define STRINGRUNTIME_H
+
+#include <cstdint>
+
+/// Script strings are immutable and length-prefixed: their int64_t length is stored right before
+/// the characters, which are also null terminated so the host can read them as C strings.
+/// Literals live in the script's code. Strings built at runtime are bump allocated in an arena
+/// of the thread that built them, so string operations never call malloc once the arena is warm.
+/// The arena owns every string it made, including the ones larger than a chunk which get their own
+/// allocation: they're all freed by reset(), or when the thread exits.
+/// The host can only pass strings made here to scripts, length() and the script's string operations
+/// read the length before the characters, a plain C string has none.
+class StringRuntime
+{
+public:
+    /// Copies str in the calling thread's arena. Strings that the host passes to scripts must come from here.
+    static const char* make(const char* str, int64_t length);
+    static const char* make(const char* str); ///< Copies a null terminated C string
+    static int64_t length(const char* str);
+    static const char* concat(const char* a, const char* b);
+    static int64_t compare(const char* a, const char* b); ///< Like memcmp, shorter strings first
+    /// Frees the strings built on the calling thread, which must not be referenced anymore.
+    /// Hosts usually reset after each request or frame.
+    static void reset();
+
+private:
+    static char* allocate(int64_t length); ///< Returns the characters of an uninitialized string
+};
+
+#endif // STRINGRUNTIME_H
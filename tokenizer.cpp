@@ -1,12 +1,48 @@
 #include "tokenizer.h"
-#include <map>
+#include "charscan.h"
+#include "compilestats.h"
+#include <llvm/ADT/Hashing.h>
+#include <cstring>
+#include <cstdlib>
 
 using namespace std;
 
-Tokenizer::Tokenizer(const std::vector<char>& Script)
-    : script{Script}, curLine{0}, curPos{0}, curTok{tok_eof}
+size_t SymbolTable::Hash::operator()(llvm::StringRef str) const
 {
+    return llvm::hash_value(str);
+}
+
+unsigned SymbolTable::intern(llvm::StringRef str)
+{
+    auto it = ids.find(str);
+    if (it != ids.end())
+        return it->second;
+
+    unsigned symbol = strings.size();
+    strings.push_back(str);
+    ids.emplace(str, symbol);
+    return symbol;
+}
+
+llvm::StringRef SymbolTable::get(unsigned symbol) const
+{
+    return strings[symbol];
+}
 
+size_t SymbolTable::size() const
+{
+    return strings.size();
+}
+
+Tokenizer::Tokenizer(llvm::StringRef Script)
+    : script{Script}, scanner(CharScanner::get()), curIndex{0}, lexTime{0}, lexed{false}
+{
+    TokenData data;
+    data.kind = tok_eof;
+    data.line = 0;
+    data.offset = 0;
+    data.intValue = 0;
+    tokens.push_back(data); // Placeholder current token before the first getNextToken()
 }
 
 Tokenizer::~Tokenizer()
@@ -14,6 +50,23 @@ Tokenizer::~Tokenizer()
 
 }
 
+void Tokenizer::lex()
+{
+    PhaseTimer timer{lexTime};
+    lexed = true;
+
+    // Generous guess, only the pages actually written to get committed
+    tokens.reserve(script.size()/4 + 2);
+
+    TokenData data = tokens.front();
+    size_t pos = 0, line = 0;
+    do {
+        data.kind = readNextToken(data, pos, line);
+        data.line = line;
+        tokens.push_back(data);
+    } while (data.kind != tok_eof);
+}
+
 int Tokenizer::readNextChar(size_t& pos, size_t &line) const
 {
     if (++pos >= script.size())
@@ -34,85 +87,123 @@ int Tokenizer::readCurChar(size_t& pos) const
         return script[pos];
 }
 
-Token Tokenizer::readNextToken(TokenData &data, size_t& pos, size_t &line) const
+void Tokenizer::advance(size_t& pos, size_t newPos, size_t& line) const
 {
-    int curChar = readCurChar(pos);
-    while (isspace(curChar))
-        curChar = readNextChar(pos, line);
-    if (curChar == EOF)
-        return tok_eof;
+    // readNextChar counts the newlines it lands on, so the one at the starting position isn't counted
+    size_t countEnd = newPos < script.size() ? newPos+1 : script.size();
+    if (pos+1 < countEnd)
+        line += scanner.countNewlines(script.data(), pos+1, countEnd);
+    pos = newPos;
+}
+
+static inline bool isAsciiAlpha(int c)
+{
+    return (unsigned)((c | 0x20) - 'a') <= 'z'-'a';
+}
+
+static inline bool isAsciiDigit(int c)
+{
+    return (unsigned)(c - '0') <= 9;
+}
+
+/// Perfect hash of the keywords, on the length and the first and last characters
+static inline unsigned keywordHash(const char* str, size_t len)
+{
+    return (len*5 + (unsigned char)str[0] + (unsigned char)str[len-1]) & 31;
+}
 
-    if (curChar == '#')
+Token Tokenizer::lookupKeyword(const char* str, size_t len)
+{
+    struct Keyword
     {
-        // Comment until end of line.
-        do {
-            curChar = readNextChar(pos, line);
-        } while (curChar != EOF && curChar != '\n' && curChar != '\r');
+        const char* name;
+        Token tok;
+    };
+    static const Keyword keywords[] = {
+        {"int", tok_int}, {"float", tok_float}, {"string", tok_string},
+        {"bool", tok_bool}, {"true", tok_true}, {"false", tok_false},
+        {"void", tok_void}, {"extern", tok_extern}, {"if", tok_if},
+        {"then", tok_then}, {"else", tok_else}, {"while", tok_while},
+        {"for", tok_for}, {"var", tok_var},
+    };
+    static const vector<const Keyword*> table = []()
+    {
+        vector<const Keyword*> t(32, nullptr);
+        for (const Keyword& kw : keywords)
+            t[keywordHash(kw.name, strlen(kw.name))] = &kw;
+        return t;
+    }();
 
-        if (curChar != EOF)
-            return readNextToken(data, pos, line);
+    const Keyword* kw = table[keywordHash(str, len)];
+    if (kw && !strncmp(kw->name, str, len) && kw->name[len] == '\0')
+        return kw->tok;
+    return tok_identifier;
+}
+
+Token Tokenizer::readNextToken(TokenData &data, size_t& pos, size_t &line)
+{
+    const char* str = script.data();
+    const size_t size = script.size();
+    int curChar;
+    while (1)
+    {
+        advance(pos, scanner.skipSpace(str, pos, size), line);
+        curChar = readCurChar(pos);
+        if (curChar != '#')
+            break;
+
+        // Comment until end of line.
+        advance(pos, scanner.findLineEnd(str, pos+1, size), line);
     }
+    if (curChar == EOF)
+        return tok_eof;
+
+    data.offset = pos;
 
     if (curChar == '"')
     {
-        data.identifier.clear();
-        while (1)
-        {
-            curChar = readNextChar(pos, line);
-            if (curChar == '\n' || curChar == '\r')
-                return tok_invalid;
-            else if (curChar == '"')
-            {
-                readNextChar(pos, line);
-                return tok_string_literal;
-            }
-            else
-                data.identifier += curChar;
-        }
+        size_t start = pos+1;
+        advance(pos, scanner.findStringEnd(str, start, size), line);
+        if (readCurChar(pos) != '"')
+            return tok_invalid;
+
+        data.symbol = symbols.intern(llvm::StringRef(str+start, pos-start));
+        readNextChar(pos, line);
+        return tok_string_literal;
     }
 
     // identifier: [a-zA-Z][a-zA-Z0-9]*
-    if (isalpha(curChar))
+    if (isAsciiAlpha(curChar))
     {
-      data.identifier = curChar;
-      while (isalnum((curChar = readNextChar(pos, line))))
-        data.identifier += curChar;
-
-      if (data.identifier == "int") return tok_int;
-      else if (data.identifier == "float") return tok_float;
-      else if (data.identifier == "string") return tok_string;
-      else if (data.identifier == "bool") return tok_bool;
-      else if (data.identifier == "true") return tok_true;
-      else if (data.identifier == "false") return tok_false;
-      else if (data.identifier == "void") return tok_void;
-      else if (data.identifier == "extern") return tok_extern;
-      else if (data.identifier == "if") return tok_if;
-      else if (data.identifier == "then") return tok_then;
-      else if (data.identifier == "else") return tok_else;
-      else return tok_identifier;
+        size_t start = pos;
+        advance(pos, scanner.skipIdentifier(str, pos+1, size), line);
+
+        Token keyword = lookupKeyword(str+start, pos-start);
+        if (keyword != tok_identifier)
+            return keyword;
+        data.symbol = symbols.intern(llvm::StringRef(str+start, pos-start));
+        return tok_identifier;
     }
 
     // Number literal: [0-9.]+
-    else if (isdigit(curChar) || curChar == '.')
+    else if (isAsciiDigit(curChar) || curChar == '.')
     {
-        data.identifier.clear();
-        do {
-            data.identifier += curChar;
-            curChar = readNextChar(pos, line);
-        } while (isdigit(curChar) || curChar == '.');
+        size_t start = pos;
+        advance(pos, scanner.skipNumber(str, pos+1, size), line);
 
-        string::size_type firstDotPos = data.identifier.find('.');
+        numBuf.assign(str+start, pos-start);
+        string::size_type firstDotPos = numBuf.find('.');
         if (firstDotPos == string::npos)
         {
-            data.intValue = strtol(data.identifier.c_str(), 0, 10);
+            data.intValue = strtol(numBuf.c_str(), 0, 10);
             return tok_int_literal;
         }
         else
         {
-            if (data.identifier.find_last_of('.') != firstDotPos)
+            if (numBuf.find_last_of('.') != firstDotPos)
                 return tok_invalid;
 
-            data.floatValue = strtod(data.identifier.c_str(), 0);
+            data.floatValue = strtod(numBuf.c_str(), 0);
             return tok_float_literal;
         }
     }
@@ -125,52 +216,81 @@ Token Tokenizer::readNextToken(TokenData &data, size_t& pos, size_t &line) const
 
 Token Tokenizer::getNextToken()
 {
-    curTok = readNextToken(curTokData, curPos, curLine);
-    return curTok;
+    if (!lexed)
+        lex();
+    if (curIndex+1 < tokens.size())
+        curIndex++;
+    return tokens[curIndex].kind;
 }
 
 Token Tokenizer::peekNextToken() const
 {
-    size_t tmpPos = curPos, tmpLine = curLine;
-    TokenData tmpData;
-    return readNextToken(tmpData, tmpPos, tmpLine);
+    if (curIndex+1 < tokens.size())
+        return tokens[curIndex+1].kind;
+    return tok_eof;
+}
+
+size_t Tokenizer::getTokenIndex() const
+{
+    return curIndex;
+}
+
+void Tokenizer::seek(size_t index)
+{
+    curIndex = index < tokens.size() ? index : tokens.size()-1;
+}
+
+const std::vector<TokenData>& Tokenizer::getTokens() const
+{
+    return tokens;
+}
+
+const SymbolTable& Tokenizer::getSymbols() const
+{
+    return symbols;
+}
+
+double Tokenizer::getLexTime() const
+{
+    return lexTime;
 }
 
 size_t Tokenizer::getCurLine() const
 {
-    return curLine;
+    return tokens[curIndex].line;
 }
 
 Token Tokenizer::getCurToken() const
 {
-    return curTok;
+    return tokens[curIndex].kind;
 }
 
-string Tokenizer::getCurIdentifier() const
+llvm::StringRef Tokenizer::getCurIdentifier() const
 {
-    return curTokData.identifier;
+    return symbols.get(tokens[curIndex].symbol);
 }
 
 long Tokenizer::getCurIntLiteral() const
 {
-    return curTokData.intValue;
+    return tokens[curIndex].intValue;
 }
 
 double Tokenizer::getCurFloatLiteral() const
 {
-    return curTokData.floatValue;
+    return tokens[curIndex].floatValue;
 }
 
 /// getTokPrecedence - Get the precedence of the pending binary operator token.
 int Tokenizer::getCurTokPrecedence() const
 {
-  if (!isascii(curTok))
-    return -1;
-
-  static std::map<char, int> opPrecedence = {{';', 2}, {'<',10}, {'+',20}, {'-',20}, {'*',40}};
-
-  // Make sure it's a declared binop.
-  int tokPrec = opPrecedence[curTok];
-  if (tokPrec <= 0) return -1;
-  return tokPrec;
+  // Only the declared binops have a precedence. A switch keeps the parser free of shared state.
+  switch ((char)getCurToken())
+  {
+    case ';': return 2;
+    case '<': return 10;
+    case '+':
+    case '-': return 20;
+    case '*': return 40;
+    default:  return -1;
+  }
 }
@@ -3,7 +3,11 @@
 
 #include <vector>
 #include <string>
+#include <unordered_map>
 #include <cstddef>
+#include <llvm/ADT/StringRef.h>
+
+struct CharScanner;
 
 /// Positive values are reserved for non-token single characters
 enum Token : char
@@ -32,40 +36,85 @@ enum Token : char
     tok_if = -30,
     tok_then = -31,
     tok_else = -32,
+    tok_while = -33,
+    tok_for = -34,
+    tok_var = -35,
 };
 
+/// A single pre-lexed token, as stored in the Tokenizer's token buffer
 struct TokenData
 {
-    std::string identifier;
-    long intValue;
-    double floatValue;
+    Token kind;
+    unsigned line; ///< Line count after reading the token
+    size_t offset; ///< Offset of the token's first character in the script
+    union
+    {
+        unsigned symbol; ///< Symbol table index, for identifiers and string literals
+        long intValue;
+        double floatValue;
+    };
 };
 
+/// Interns identifiers and string literals, so each distinct string is only stored once.
+/// Symbols are views into the script, they are not copied.
+class SymbolTable
+{
+public:
+    unsigned intern(llvm::StringRef str);
+    llvm::StringRef get(unsigned symbol) const;
+    size_t size() const;
+
+private:
+    struct Hash
+    {
+        size_t operator()(llvm::StringRef str) const;
+    };
+
+    std::vector<llvm::StringRef> strings;
+    std::unordered_map<llvm::StringRef, unsigned, Hash> ids;
+};
+
+/// Lexes the whole script once into a flat token buffer, then walks it by index.
+/// Lexing waits for the first getNextToken(), so scripts loaded from the object cache are never lexed.
+/// The script is not copied and must outlive the Tokenizer.
 class Tokenizer
 {
 public:
-    Tokenizer(const std::vector<char>& script);
+    Tokenizer(llvm::StringRef script);
     ~Tokenizer();
 
     Token getNextToken();
     Token peekNextToken() const;
     Token getCurToken() const;
-    std::string getCurIdentifier() const;
+    llvm::StringRef getCurIdentifier() const;
     long getCurIntLiteral() const;
     double getCurFloatLiteral() const;
     size_t getCurLine() const;
     int getCurTokPrecedence() const;
 
+    size_t getTokenIndex() const; ///< Index of the current token, for backtracking
+    void seek(size_t index); ///< Makes the token at index the current token
+    const std::vector<TokenData>& getTokens() const;
+    const SymbolTable& getSymbols() const;
+    double getLexTime() const; ///< Seconds spent lexing the script
+
 private:
-    Token readNextToken(TokenData& data, size_t& pos, size_t& line) const;
+    void lex();
+    Token readNextToken(TokenData& data, size_t& pos, size_t& line);
     int readNextChar(size_t& pos, size_t& line) const; ///< Returns EOF on error
     int readCurChar(size_t& pos) const; ///< Returns EOF on error
+    void advance(size_t& pos, size_t newPos, size_t& line) const; ///< Like calling readNextChar until pos is newPos
+    static Token lookupKeyword(const char* str, size_t len);
 
 private:
-    const std::vector<char>& script;
-    size_t curLine, curPos;
-    Token curTok;
-    TokenData curTokData;
+    llvm::StringRef script;
+    const CharScanner& scanner;
+    std::vector<TokenData> tokens;
+    SymbolTable symbols;
+    std::string numBuf; ///< Reused to NUL-terminate number literals for strtol/strtod
+    size_t curIndex; ///< Index of the current token. Index 0 is a placeholder before the first token.
+    double lexTime;
+    bool lexed;
 };
 
 #endif // TOKENIZER_H
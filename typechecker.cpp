@@ -0,0 +1,381 @@
+#include "typechecker.h"
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Support/Casting.h>
+#include <algorithm>
+#include <cstdio>
+
+using namespace llvm;
+
+TypeChecker::TypeChecker(ASTArena &Arena, LLVMContext& Context)
+    : arena(Arena), context(Context), curProto{nullptr}, errors{0}
+{
+    // The StringRuntime's functions that scripts may declare, the JIT resolves them itself
+    Type* stringTy = Type::getInt8PtrTy(context);
+    declareNative("__ls_string_length", FunctionType::get(Type::getInt64Ty(context), stringTy, false));
+}
+
+Type* TypeChecker::error(const ExprAST* ast, const std::string& str)
+{
+    fprintf(stderr, "Error on line %u: %s\n", ast->getLine(), str.c_str());
+    errors++;
+    return 0;
+}
+
+bool TypeChecker::errorP(const PrototypeAST* ast, const std::string& str)
+{
+    fprintf(stderr, "Error in prototype of '%s': %s\n", ast->name.str().c_str(), str.c_str());
+    return false;
+}
+
+static std::string typeName(Type* type)
+{
+    if (type->isIntegerTy(64)) return "int";
+    else if (type->isDoubleTy()) return "float";
+    else if (type->isIntegerTy(1)) return "bool";
+    else if (type->isPointerTy()) return "string";
+    else return "void";
+}
+
+/// Ints, floats and bools convert to a branch condition
+static bool isCondition(Type* type)
+{
+    return type->isDoubleTy() || type->isIntegerTy(64) || type->isIntegerTy(1);
+}
+
+bool TypeChecker::declare(PrototypeAST* ast, bool isDefinition)
+{
+    // Anonymous functions can't be called, no need to remember them
+    if (ast->name.empty())
+        return true;
+
+    FunctionType* type = FunctionType::get(ast->retType, ast->argTypes, false);
+    auto native = natives.find(ast->name);
+    if (native != natives.end())
+    {
+        if (isDefinition)
+            return errorP(ast, "native functions can't be redefined");
+        if (native->second != type)
+            return errorP(ast, "extern doesn't match the signature of the native function");
+    }
+
+    auto it = functions.find(ast->name);
+    if (it == functions.end())
+    {
+        functions[ast->name] = Signature{type, isDefinition};
+        return true;
+    }
+
+    Signature& sig = it->second;
+    if (sig.defined && isDefinition)
+        return errorP(ast, "redefinition of function");
+    if (sig.type->getNumParams() != ast->argTypes.size())
+        return errorP(ast, "redefinition of function with different # args");
+    if (sig.type != type)
+        return errorP(ast, "redefinition of function with different types");
+    sig.defined |= isDefinition;
+    return true;
+}
+
+void TypeChecker::declareNative(StringRef name, FunctionType* type)
+{
+    natives[name] = type;
+}
+
+FunctionType* TypeChecker::getDefinition(StringRef name) const
+{
+    auto it = functions.find(name);
+    if (it == functions.end() || !it->second.defined)
+        return 0;
+    return it->second.type;
+}
+
+std::vector<std::pair<StringRef, FunctionType*>> TypeChecker::getDefinitions() const
+{
+    std::vector<std::pair<StringRef, FunctionType*>> definitions;
+    for (auto& function : functions)
+        if (function.second.defined)
+            definitions.push_back(std::make_pair(function.first(), function.second.type));
+    return definitions;
+}
+
+void TypeChecker::declareDefinition(StringRef name, FunctionType* type)
+{
+    functions[name] = Signature{type, true};
+}
+
+bool TypeChecker::check(PrototypeAST* ast)
+{
+    return declare(ast, false);
+}
+
+bool TypeChecker::check(FunctionAST* ast)
+{
+    // Declare first, so the function can call itself
+    bool wasDeclared = functions.count(ast->proto->name);
+    if (!declare(ast->proto, true))
+        return false;
+
+    curProto = ast->proto;
+    locals.clear();
+    errors = 0;
+    Type* retType = ast->proto->retType;
+    if (Type* bodyType = check(ast->body))
+    {
+        if (retType->isVoidTy() && !bodyType->isVoidTy())
+            fprintf(stderr, "Warning: Non-void return value in void function '%s'\n",
+                    ast->proto->name.str().c_str());
+        else if (!retType->isVoidTy() && bodyType != retType)
+            error(ast->body, "Return value type doesn't match function prototype in '"
+                             +ast->proto->name.str()+"'");
+    }
+    curProto = nullptr;
+
+    if (!errors)
+        return true;
+
+    // Nothing will be generated for this function, forget the definition
+    if (!ast->proto->name.empty())
+    {
+        if (wasDeclared)
+            functions[ast->proto->name].defined = false;
+        else
+            functions.erase(ast->proto->name);
+    }
+    return false;
+}
+
+ExprAST* TypeChecker::castTo(ExprAST* ast, Type* type)
+{
+    CastExprAST* cast = arena.make<CastExprAST>(ast);
+    cast->line = ast->line;
+    cast->type = type;
+    return cast;
+}
+
+Type* TypeChecker::check(ExprAST* ast)
+{
+    LLVMContext& C = context;
+    Type* type = 0;
+    switch (ast->getKind())
+    {
+        case ExprAST::IntLit:    type = Type::getInt64Ty(C); break;
+        case ExprAST::FloatLit:  type = Type::getDoubleTy(C); break;
+        case ExprAST::StringLit: type = Type::getInt8PtrTy(C); break;
+        case ExprAST::BoolLit:   type = Type::getInt1Ty(C); break;
+        case ExprAST::Void:      type = Type::getVoidTy(C); break;
+        case ExprAST::Variable:  type = check(static_cast<VariableExprAST*>(ast)); break;
+        case ExprAST::Unary:     type = check(static_cast<UnaryExprAST*>(ast)); break;
+        case ExprAST::Binary:    type = check(static_cast<BinaryExprAST*>(ast)); break;
+        case ExprAST::Block:     type = check(static_cast<BlockExprAST*>(ast)); break;
+        case ExprAST::Call:      type = check(static_cast<CallExprAST*>(ast)); break;
+        case ExprAST::If:        type = check(static_cast<IfExprAST*>(ast)); break;
+        case ExprAST::While:     type = check(static_cast<WhileExprAST*>(ast)); break;
+        case ExprAST::For:       type = check(static_cast<ForExprAST*>(ast)); break;
+        case ExprAST::Var:       type = check(static_cast<VarExprAST*>(ast)); break;
+        case ExprAST::Assign:    type = check(static_cast<AssignExprAST*>(ast)); break;
+        case ExprAST::Cast:      type = ast->type; break; // Only we insert casts, already typed
+    }
+    ast->type = type;
+    return type;
+}
+
+Type* TypeChecker::checkScope(ExprAST* ast)
+{
+    size_t scope = locals.size();
+    Type* type = check(ast);
+    locals.resize(scope);
+    return type;
+}
+
+Type* TypeChecker::check(VariableExprAST* ast)
+{
+    // Locals shadow the arguments
+    for (auto it = locals.rbegin(); it != locals.rend(); ++it)
+        if (it->name == ast->name)
+            return it->type;
+    for (size_t i = 0; i < curProto->argNames.size(); ++i)
+        if (curProto->argNames[i] == ast->name)
+            return curProto->argTypes[i];
+    return error(ast, "Unknown variable name: "+ast->name.str());
+}
+
+Type* TypeChecker::check(UnaryExprAST* ast)
+{
+    Type* type = check(ast->rhs);
+    if (!type)
+        return 0;
+
+    if (ast->op != '+' && ast->op != '-')
+        return error(ast, "invalid unary operator");
+    if (type->isVoidTy() || type->isPointerTy())
+        return error(ast, "Invalid unary expression on a '"+typeName(type)+"'");
+    return type;
+}
+
+Type* TypeChecker::check(BinaryExprAST* ast)
+{
+    Type* l = check(ast->lhs);
+    Type* r = check(ast->rhs);
+    if (!l || !r)
+        return 0;
+
+    if (ast->op != '+' && ast->op != '-' && ast->op != '*' && ast->op != '<')
+        return error(ast, "invalid binary operator");
+    if (l->isVoidTy() || r->isVoidTy())
+        return error(ast, "Invalid binary expression, operands can't be void");
+    if (l->isPointerTy() || r->isPointerTy())
+    {
+        if (l != r)
+            return error(ast, "Invalid binary expression,  no cast from or to 'string' exists");
+        // Concatenation and ordering
+        if (ast->op == '+')
+            return l;
+        if (ast->op == '<')
+            return Type::getInt1Ty(context);
+        return error(ast, "Invalid binary expression, only + and < are defined on strings");
+    }
+
+    // Ints and bools are converted to float if the other side is a float
+    if (l != r)
+    {
+        if (l->isDoubleTy())
+            ast->rhs = castTo(ast->rhs, l);
+        else if (r->isDoubleTy())
+            ast->lhs = castTo(ast->lhs, r);
+        else
+            return error(ast, "Invalid binary expression, no cast between '"
+                              +typeName(l)+"' and '"+typeName(r)+"' exists");
+    }
+
+    if (ast->op == '<')
+        return Type::getInt1Ty(context);
+    return ast->lhs->type;
+}
+
+Type* TypeChecker::check(BlockExprAST* ast)
+{
+    // Check everything, so all the errors get reported
+    size_t scope = locals.size();
+    Type* type = 0;
+    for (ExprAST* expr : ast->exprs)
+        type = check(expr);
+    locals.resize(scope);
+    return type;
+}
+
+Type* TypeChecker::check(CallExprAST* ast)
+{
+    bool argsValid = true;
+    for (ExprAST* arg : ast->args)
+        argsValid &= check(arg) != 0;
+
+    auto it = functions.find(ast->callee);
+    if (it == functions.end())
+        return error(ast, "Unknown function referenced: "+ast->callee.str());
+
+    FunctionType* type = it->second.type;
+    if (type->getNumParams() != ast->args.size())
+        return error(ast, "Incorrect number of arguments passed to "+ast->callee.str());
+
+    if (!argsValid)
+        return 0;
+    for (unsigned i = 0, e = ast->args.size(); i != e; ++i)
+        if (ast->args[i]->type != type->getParamType(i))
+            return error(ast, "Incorrect argument type for argument "
+                              +std::to_string(i+1)+" in function call of "+ast->callee.str());
+
+    return type->getReturnType();
+}
+
+Type* TypeChecker::check(IfExprAST* ast)
+{
+    Type* condType = check(ast->condAST);
+    Type* thenType = checkScope(ast->thenAST);
+    Type* elseType = checkScope(ast->elseAST);
+    if (!condType || !thenType || !elseType)
+        return 0;
+
+    if (!isCondition(condType))
+        return error(ast, "Expression in if must be an int, float, or bool");
+    if (thenType != elseType)
+        return error(ast, "The 'then' and 'else' expressions must return the same type");
+    return thenType;
+}
+
+Type* TypeChecker::check(WhileExprAST* ast)
+{
+    Type* condType = check(ast->condAST);
+    Type* bodyType = checkScope(ast->bodyAST);
+    if (!condType || !bodyType)
+        return 0;
+
+    if (!isCondition(condType))
+        return error(ast, "Expression in while must be an int, float, or bool");
+    return Type::getVoidTy(context);
+}
+
+Type* TypeChecker::check(ForExprAST* ast)
+{
+    Type* startType = check(ast->startAST);
+    Type* endType = check(ast->endAST);
+
+    size_t scope = locals.size();
+    locals.push_back(Local{ast->varName, Type::getInt64Ty(context), false});
+    Type* bodyType = check(ast->bodyAST);
+    locals.resize(scope);
+    if (!startType || !endType || !bodyType)
+        return 0;
+
+    if (!startType->isIntegerTy(64) || !endType->isIntegerTy(64))
+        return error(ast, "The range of a for loop must be ints");
+    return Type::getVoidTy(context);
+}
+
+Type* TypeChecker::check(VarExprAST* ast)
+{
+    Type* type = check(ast->initAST);
+    if (!type)
+        return 0;
+
+    if (type->isVoidTy())
+        return error(ast, "Variable '"+ast->name.str()+"' can't be initialized with a void value");
+    ArrayRef<StringRef> args = curProto->argNames;
+    bool defined = std::find(args.begin(), args.end(), ast->name) != args.end();
+    for (const Local& local : locals)
+        defined |= local.name == ast->name;
+    if (defined)
+        return error(ast, "Variable '"+ast->name.str()+"' is already defined");
+
+    locals.push_back(Local{ast->name, type, true});
+    return Type::getVoidTy(context);
+}
+
+Type* TypeChecker::check(AssignExprAST* ast)
+{
+    Type* valueType = check(ast->valueAST);
+
+    auto it = locals.rbegin();
+    while (it != locals.rend() && it->name != ast->name)
+        ++it;
+    if (it == locals.rend())
+    {
+        ArrayRef<StringRef> args = curProto->argNames;
+        if (std::find(args.begin(), args.end(), ast->name) != args.end())
+            return error(ast, "Can't assign the argument '"+ast->name.str()+"', declare a var instead");
+        return error(ast, "Unknown variable name: "+ast->name.str());
+    }
+    if (!it->assignable)
+        return error(ast, "Can't assign the for loop variable '"+ast->name.str()+"'");
+    if (!valueType)
+        return 0;
+
+    // Like in binary expressions, ints and bools convert to float
+    if (valueType != it->type)
+    {
+        if (!it->type->isDoubleTy() || valueType->isVoidTy() || valueType->isPointerTy())
+            return error(ast, "Can't assign a '"+typeName(valueType)+"' to the '"
+                              +typeName(it->type)+"' variable '"+ast->name.str()+"'");
+        ast->valueAST = castTo(ast->valueAST, it->type);
+    }
+    return Type::getVoidTy(context);
+}
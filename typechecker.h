@@ -0,0 +1,71 @@
+#ifndef TYPECHECKER_H
+#define TYPECHECKER_H
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "exprast.h"
+
+/// Resolves the type of every expression and inserts the implicit casts, before any IR is built.
+/// All the errors of a function are reported, and CodeGen can then assume the AST is well typed.
+class TypeChecker
+{
+public:
+    TypeChecker(ASTArena& Arena, llvm::LLVMContext& Context);
+
+    bool check(PrototypeAST* ast); ///< Declares an extern function
+    bool check(FunctionAST* ast); ///< Declares and checks a function definition
+    /// The host provides name, it can only be declared extern with this type
+    void declareNative(llvm::StringRef name, llvm::FunctionType* type);
+    llvm::FunctionType* getDefinition(llvm::StringRef name) const; ///< Null unless name was defined
+    std::vector<std::pair<llvm::StringRef, llvm::FunctionType*>> getDefinitions() const;
+    /// For scripts loaded from the object cache, which were checked before they were cached
+    void declareDefinition(llvm::StringRef name, llvm::FunctionType* type);
+
+private:
+    llvm::Type* check(ExprAST* ast); ///< Returns the type of ast, or 0 after reporting an error
+    llvm::Type* check(VariableExprAST* ast);
+    llvm::Type* check(UnaryExprAST* ast);
+    llvm::Type* check(BinaryExprAST* ast);
+    llvm::Type* check(BlockExprAST* ast);
+    llvm::Type* check(CallExprAST* ast);
+    llvm::Type* check(IfExprAST* ast);
+    llvm::Type* check(WhileExprAST* ast);
+    llvm::Type* check(ForExprAST* ast);
+    llvm::Type* check(VarExprAST* ast);
+    llvm::Type* check(AssignExprAST* ast);
+    llvm::Type* checkScope(ExprAST* ast); ///< Like check, the vars declared in ast aren't visible after it
+
+    bool declare(PrototypeAST* ast, bool isDefinition);
+    ExprAST* castTo(ExprAST* ast, llvm::Type* type); ///< Wraps ast in a CastExprAST
+    llvm::Type* error(const ExprAST* ast, const std::string& str);
+    bool errorP(const PrototypeAST* ast, const std::string& str);
+
+private:
+    struct Signature
+    {
+        llvm::FunctionType* type;
+        bool defined;
+    };
+    struct Local
+    {
+        llvm::StringRef name;
+        llvm::Type* type;
+        bool assignable; ///< Vars are, for loop variables aren't
+    };
+
+    ASTArena& arena;
+    llvm::LLVMContext& context;
+    llvm::StringMap<Signature> functions;
+    llvm::StringMap<llvm::FunctionType*> natives;
+    PrototypeAST* curProto; ///< Function being checked
+    /// For loop variables and vars in scope, innermost last. A var can't shadow another variable,
+    /// so CodeGen can bind each name to a single value at a time.
+    llvm::SmallVector<Local, 8> locals;
+    unsigned errors; ///< Errors reported in the current function
+};
+
+#endif // TYPECHECKER_H